@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <map>
+#include <time.h>
+#include <glib/gstdio.h>
+#include <util.h>
+
+#include "httputils.h"
+
+#include "httpcache.h"
+
+using std::map;
+
+namespace
+{
+
+// When the cache grows over MAX_CACHE_SIZE, least recently used files are removed until it shrinks
+// to CACHE_SIZE_AFTER_EVICTION.
+const uint64 MAX_CACHE_SIZE = 64 * 1024 * 1024;
+const uint64 CACHE_SIZE_AFTER_EVICTION = MAX_CACHE_SIZE / 4 * 3;
+// Files, validated less than this time ago, are returned without asking the server (in seconds).
+const time_t CACHE_FRESH_TIME = 24 * 60 * 60;
+
+// One file in the cache. Each file <hash> is accompanied by <hash>.meta, which contains
+// three lines: the time of last validation, ETag and Last-Modified.
+struct CacheEntry
+{
+    uint64 size;
+    // Modification time of the file, which is updated on each access.
+    time_t last_access;
+};
+
+struct CacheMeta
+{
+    time_t validated;
+    string etag;
+    string last_modified;
+};
+
+// Cache index, loaded from disk upon first use. The keys are file names (hashes of URL paths).
+map<string, CacheEntry> cache_entries;
+uint64 cache_size = 0;
+bool cache_loaded = false;
+// Callbacks for files, which are currently being downloaded, keyed by the connection, which
+// downloads the file, and the hash. The same sticker or avatar is often requested several times
+// at once. The callbacks capture their connection, so the requests are not shared between accounts.
+typedef std::pair<PurpleConnection*, string> PendingKey;
+map<PendingKey, vector<HttpCacheCb>> cache_pending;
+
+const string& get_cache_dir()
+{
+    static string cache_dir;
+    if (cache_dir.empty()) {
+        char* dir = g_build_filename(purple_user_dir(), "vkcom", "cache", nullptr);
+        g_mkdir_with_parents(dir, 0700);
+        cache_dir = dir;
+        g_free(dir);
+    }
+    return cache_dir;
+}
+
+string get_cache_path(const string& hash, const char* suffix = "")
+{
+    return get_cache_dir() + G_DIR_SEPARATOR_S + hash + suffix;
+}
+
+// Returns hash of the URL path, used as the file name.
+string get_cache_hash(const string& url)
+{
+    size_t path_start = url.find("://");
+    path_start = url.find('/', path_start == string::npos ? 0 : path_start + 3);
+    string path = path_start == string::npos ? url : url.substr(path_start);
+
+    char* hash = g_compute_checksum_for_string(G_CHECKSUM_MD5, path.data(), path.size());
+    string ret = hash;
+    g_free(hash);
+    return ret;
+}
+
+bool is_meta_filename(const char* filename)
+{
+    return g_str_has_suffix(filename, ".meta");
+}
+
+void load_cache_index()
+{
+    if (cache_loaded)
+        return;
+    cache_loaded = true;
+
+    GDir* dir = g_dir_open(get_cache_dir().data(), 0, nullptr);
+    if (!dir) {
+        vkcom_debug_error("Unable to open cache directory %s\n", get_cache_dir().data());
+        return;
+    }
+    while (const char* filename = g_dir_read_name(dir)) {
+        if (is_meta_filename(filename))
+            continue;
+        GStatBuf buf;
+        if (g_stat(get_cache_path(filename).data(), &buf) != 0)
+            continue;
+        cache_entries[filename] = { (uint64)buf.st_size, buf.st_mtime };
+        cache_size += buf.st_size;
+    }
+    g_dir_close(dir);
+    vkcom_debug_info("Loaded cache index: %zu files, %llu bytes\n", cache_entries.size(),
+                     (unsigned long long)cache_size);
+}
+
+void remove_cache_entry(const string& hash)
+{
+    auto it = cache_entries.find(hash);
+    if (it == cache_entries.end())
+        return;
+    cache_size -= it->second.size;
+    cache_entries.erase(it);
+    g_remove(get_cache_path(hash).data());
+    g_remove(get_cache_path(hash, ".meta").data());
+}
+
+// Removes least recently used files until the cache fits in the limit.
+void evict_cache_entries()
+{
+    if (cache_size <= MAX_CACHE_SIZE)
+        return;
+
+    vector<std::pair<time_t, string>> by_access;
+    for (const auto& it: cache_entries)
+        by_access.emplace_back(it.second.last_access, it.first);
+    std::sort(by_access.begin(), by_access.end());
+
+    size_t removed = 0;
+    for (const auto& it: by_access) {
+        if (cache_size <= CACHE_SIZE_AFTER_EVICTION)
+            break;
+        remove_cache_entry(it.second);
+        removed++;
+    }
+    vkcom_debug_info("Removed %zu files from cache\n", removed);
+}
+
+// Updates last access time in the index and on disk, so that it persists between restarts.
+void touch_cache_entry(const string& hash)
+{
+    cache_entries[hash].last_access = time(nullptr);
+    g_utime(get_cache_path(hash).data(), nullptr);
+}
+
+bool read_cache_meta(const string& hash, CacheMeta& meta)
+{
+    char* contents;
+    if (!g_file_get_contents(get_cache_path(hash, ".meta").data(), &contents, nullptr, nullptr))
+        return false;
+    char** lines = g_strsplit(contents, "\n", 3);
+    bool ok = g_strv_length(lines) == 3;
+    if (ok) {
+        meta.validated = atoll(lines[0]);
+        meta.etag = lines[1];
+        meta.last_modified = lines[2];
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return ok;
+}
+
+void write_cache_meta(const string& hash, const CacheMeta& meta)
+{
+    string contents = str_format("%lld\n%s\n%s", (long long)meta.validated, meta.etag.data(),
+                                 meta.last_modified.data());
+    g_file_set_contents(get_cache_path(hash, ".meta").data(), contents.data(), contents.size(), nullptr);
+}
+
+bool read_cache_data(const string& hash, string& data)
+{
+    char* contents;
+    gsize size;
+    if (!g_file_get_contents(get_cache_path(hash).data(), &contents, &size, nullptr)) {
+        // The file has been removed behind our back.
+        remove_cache_entry(hash);
+        return false;
+    }
+    data.assign(contents, size);
+    g_free(contents);
+    touch_cache_entry(hash);
+    return true;
+}
+
+void write_cache_data(const string& hash, const char* data, size_t size, const CacheMeta& meta)
+{
+    remove_cache_entry(hash);
+    GError* error = nullptr;
+    if (!g_file_set_contents(get_cache_path(hash).data(), data, size, &error)) {
+        vkcom_debug_error("Unable to write cache file: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+    write_cache_meta(hash, meta);
+
+    cache_entries[hash] = { size, time(nullptr) };
+    cache_size += size;
+    evict_cache_entries();
+}
+
+// Calls all callbacks, waiting for key.
+void call_pending_callbacks(const PendingKey& key, const char* data, size_t size)
+{
+    auto it = cache_pending.find(key);
+    // The requests have been cancelled upon closing the connection.
+    if (it == cache_pending.end())
+        return;
+    vector<HttpCacheCb> callbacks = std::move(it->second);
+    cache_pending.erase(it);
+    for (const HttpCacheCb& cb: callbacks)
+        cb(data, size);
+}
+
+} // End of anonymous namespace
+
+void http_get_cached(PurpleConnection* gc, const string& url, const HttpCacheCb& callback)
+{
+    load_cache_index();
+
+    string hash = get_cache_hash(url);
+    PendingKey key(gc, hash);
+    auto pending_it = cache_pending.find(key);
+    if (pending_it != cache_pending.end()) {
+        pending_it->second.push_back(callback);
+        return;
+    }
+
+    CacheMeta meta;
+    bool cached = contains(cache_entries, hash) && read_cache_meta(hash, meta);
+    if (cached && time(nullptr) - meta.validated < CACHE_FRESH_TIME) {
+        string data;
+        if (read_cache_data(hash, data)) {
+            callback(data.data(), data.size());
+            return;
+        }
+        cached = false;
+    }
+
+    PurpleHttpRequest* request = purple_http_request_new(url.data());
+    if (cached) {
+        if (!meta.etag.empty())
+            purple_http_request_header_set(request, "If-None-Match", meta.etag.data());
+        if (!meta.last_modified.empty())
+            purple_http_request_header_set(request, "If-Modified-Since", meta.last_modified.data());
+    }
+
+    cache_pending[key].push_back(callback);
+    PurpleHttpConnection* hc = http_request(gc, request, [=](PurpleHttpConnection*,
+                                                             PurpleHttpResponse* response) {
+        int code = purple_http_response_get_code(response);
+        if (cached && code == 304) {
+            CacheMeta new_meta = meta;
+            new_meta.validated = time(nullptr);
+            write_cache_meta(hash, new_meta);
+
+            string data;
+            if (read_cache_data(hash, data))
+                call_pending_callbacks(key, data.data(), data.size());
+            else
+                call_pending_callbacks(key, nullptr, 0);
+        } else if (purple_http_response_is_successful(response)) {
+            CacheMeta new_meta;
+            new_meta.validated = time(nullptr);
+            const char* etag = purple_http_response_get_header(response, "ETag");
+            new_meta.etag = etag ? etag : "";
+            const char* last_modified = purple_http_response_get_header(response, "Last-Modified");
+            new_meta.last_modified = last_modified ? last_modified : "";
+
+            size_t size;
+            const char* data = purple_http_response_get_data(response, &size);
+            write_cache_data(hash, data, size, new_meta);
+            call_pending_callbacks(key, data, size);
+        } else {
+            vkcom_debug_error("Unable to download %s: %s\n", url.data(),
+                              purple_http_response_get_error(response));
+            // Return the stale file, it is better than nothing.
+            string data;
+            if (cached && read_cache_data(hash, data))
+                call_pending_callbacks(key, data.data(), data.size());
+            else
+                call_pending_callbacks(key, nullptr, 0);
+        }
+    });
+    purple_http_request_unref(request);
+    // The connection is closing, the callbacks will never be called.
+    if (!hc)
+        cache_pending.erase(key);
+}
+
+void cancel_http_cache_requests(PurpleConnection* gc)
+{
+    auto it = cache_pending.lower_bound(PendingKey(gc, string()));
+    while (it != cache_pending.end() && it->first.first == gc)
+        it = cache_pending.erase(it);
+}
@@ -0,0 +1,26 @@
+// Persistent disk cache for images (thumbnails, buddy icons, user photos).
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+
+// Called with the contents of the file or nullptr if it could not be downloaded and is not cached.
+typedef function_ptr<void(const char* data, size_t size)> HttpCacheCb;
+
+// Returns the file at url from the cache if it has been downloaded recently, downloads it
+// otherwise. Files are keyed by URL path without the host, because Vk.com spreads the same files
+// over several hosts for load balancing. Stale files are revalidated with If-None-Match and
+// If-Modified-Since and are returned as is if the server is unreachable.
+//
+// The cache is stored in purple user dir and shared by all accounts. When it grows over the size
+// limit, least recently used files are removed.
+//
+// The callback is not called if the connection is closed before the file is received.
+void http_get_cached(PurpleConnection* gc, const string& url, const HttpCacheCb& callback);
+
+// Drops the callbacks for the files, which are being downloaded for gc, so that the requests,
+// which are never going to finish (e.g. waiting for a retry timer), do not block the following
+// ones. Must be called upon closing connection.
+void cancel_http_cache_requests(PurpleConnection* gc);
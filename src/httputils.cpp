@@ -16,6 +16,25 @@ PurpleHttpConnection* http_get(PurpleConnection* gc, const string& url, const Ht
 namespace
 {
 
+// Helper for http_request and http_get_no_retry.
+PurpleHttpConnection* http_request_impl(PurpleConnection* gc, PurpleHttpRequest* request,
+                                        const HttpCallback& callback, int retries);
+
+} // End anonymous namespace
+
+PurpleHttpConnection* http_get_no_retry(PurpleConnection* gc, const string& url, int timeout,
+                                        const HttpCallback& callback)
+{
+    PurpleHttpRequest* request = purple_http_request_new(url.data());
+    purple_http_request_set_timeout(request, timeout);
+    PurpleHttpConnection* hc = http_request_impl(gc, request, callback, 0);
+    purple_http_request_unref(request);
+    return hc;
+}
+
+namespace
+{
+
 struct HttpUserData
 {
     HttpCallback callback;
@@ -51,25 +70,34 @@ void http_cb(PurpleHttpConnection* http_conn, PurpleHttpResponse* response, void
     }
 }
 
-} // End anonymous namespace
-
-PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
-                                   const HttpCallback& callback)
+PurpleHttpConnection* http_request_impl(PurpleConnection* gc, PurpleHttpRequest* request,
+                                        const HttpCallback& callback, int retries)
 {
     VkData& gc_data = get_data(gc);
     if (gc_data.is_closing()) {
         vkcom_debug_error("Attempting to connect while closing the connection\n");
         return nullptr;
     }
+    if (dropped_in_replay(gc, "purple_http_request"))
+        return nullptr;
 
     purple_http_request_set_keepalive_pool(request, gc_data.get_keepalive_pool());
     HttpUserData* data = new HttpUserData();
     data->callback = callback;
-    data->retries = 0;
+    // http_cb retries only while data->retries is less than MAX_HTTP_RETRIES.
+    data->retries = MAX_HTTP_RETRIES - retries;
     PurpleHttpConnection* hc = purple_http_request(gc, request, http_cb, data);
     return hc;
 }
 
+} // End anonymous namespace
+
+PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
+                                   const HttpCallback& callback)
+{
+    return http_request_impl(gc, request, callback, MAX_HTTP_RETRIES);
+}
+
 namespace
 {
 
@@ -11,6 +11,11 @@ typedef function_ptr<void(PurpleHttpConnection *http_conn, PurpleHttpResponse *r
 // Utility function: run purple_http_get with keep-alive pool and add to connection set.
 PurpleHttpConnection* http_get(PurpleConnection *gc, const string& url, const HttpCallback& callback);
 
+// Same as http_get, but does not retry on network errors and cancels the request after timeout
+// seconds. Used by Long Poll, which has its own reconnection logic.
+PurpleHttpConnection* http_get_no_retry(PurpleConnection* gc, const string& url, int timeout,
+                                        const HttpCallback& callback);
+
 // Utility function: run purple_http_get with keep-alive pool and add to connection set.
 PurpleHttpConnection* http_request(PurpleConnection* gc, PurpleHttpRequest* request,
                                    const HttpCallback& callback);
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <gio/gio.h>
+#ifdef HAVE_GDK_PIXBUF
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#endif
+
+#include "vk-common.h"
+
+#include "imageutils.h"
+
+namespace
+{
+
+#ifdef HAVE_GDK_PIXBUF
+
+// JPEG quality of the downscaled images without alpha channel, the others are saved as PNG.
+const char SCALED_JPEG_QUALITY[] = "85";
+
+// The state of one scaling task. gc and callback are accessed only from the main thread, the rest
+// is owned by the worker thread until it finishes.
+struct ScaleImageData
+{
+    PurpleConnection* gc;
+    string data;
+    int max_size;
+    // Set if the image does not fit into the box.
+    bool too_big;
+    // Empty if the image must be returned as is.
+    string scaled;
+    ScaledImageCb callback;
+};
+
+// Runs in the worker thread: decodes data and sets scaled.
+void scale_image(ScaleImageData& task);
+// Returns true if gc has not been closed.
+bool connection_is_alive(PurpleConnection* gc);
+
+#endif
+
+} // End of anonymous namespace
+
+#ifdef HAVE_GDK_PIXBUF
+
+void scale_image_async(PurpleConnection* gc, const char* data, size_t size, int max_size,
+                       const ScaledImageCb& callback)
+{
+    if (max_size <= 0) {
+        callback(data, size);
+        return;
+    }
+
+    ScaleImageData* task_data = new ScaleImageData{ gc, string(data, size), max_size, false, string(),
+                                                     callback };
+    GTask* task = g_task_new(nullptr, nullptr, [](GObject*, GAsyncResult* result, void*) {
+        ScaleImageData* param = (ScaleImageData*)g_task_get_task_data(G_TASK(result));
+        // The task data can be freed in the worker thread, so the callback (and everything it has
+        // captured) is released here.
+        ScaledImageCb cb = param->callback;
+        param->callback = nullptr;
+        if (!connection_is_alive(param->gc))
+            return;
+        if (param->scaled.empty())
+            cb(param->data.data(), param->data.size());
+        else
+            cb(param->scaled.data(), param->scaled.size());
+    }, nullptr);
+    g_task_set_task_data(task, task_data, [](void* p) {
+        delete (ScaleImageData*)p;
+    });
+    g_task_run_in_thread(task, [](GTask* t, void*, void* p, GCancellable*) {
+        scale_image(*(ScaleImageData*)p);
+        g_task_return_boolean(t, true);
+    });
+    g_object_unref(task);
+}
+
+#else
+
+void scale_image_async(PurpleConnection*, const char* data, size_t size, int, const ScaledImageCb& callback)
+{
+    callback(data, size);
+}
+
+#endif
+
+namespace
+{
+
+#ifdef HAVE_GDK_PIXBUF
+
+void scale_image(ScaleImageData& task)
+{
+    // The size is set before the image is decoded, so that the loader can decode JPEGs directly
+    // at the lower resolution.
+    GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(+[](GdkPixbufLoader* l, int width, int height,
+                                                             void* user_data) {
+        ScaleImageData& param = *(ScaleImageData*)user_data;
+        if (width <= param.max_size && height <= param.max_size)
+            return;
+        double scale = (double)param.max_size / std::max(width, height);
+        gdk_pixbuf_loader_set_size(l, std::max(int(width * scale), 1), std::max(int(height * scale), 1));
+        param.too_big = true;
+    }), &task);
+
+    GError* error = nullptr;
+    bool ok = gdk_pixbuf_loader_write(loader, (const guchar*)task.data.data(), task.data.size(), &error)
+              && gdk_pixbuf_loader_close(loader, &error);
+    if (!ok) {
+        // purple_debug is not thread-safe, so the error is not logged and the image is returned as is.
+        g_clear_error(&error);
+        gdk_pixbuf_loader_close(loader, nullptr);
+        g_object_unref(loader);
+        return;
+    }
+
+    GdkPixbuf* pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+    if (task.too_big && pixbuf) {
+        char* buffer = nullptr;
+        gsize buffer_size = 0;
+        if (gdk_pixbuf_get_has_alpha(pixbuf))
+            ok = gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &buffer_size, "png", &error, nullptr);
+        else
+            ok = gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &buffer_size, "jpeg", &error, "quality",
+                                           SCALED_JPEG_QUALITY, nullptr);
+        if (ok)
+            task.scaled.assign(buffer, buffer_size);
+        g_clear_error(&error);
+        g_free(buffer);
+    }
+    g_object_unref(loader);
+}
+
+bool connection_is_alive(PurpleConnection* gc)
+{
+    if (!g_list_find(purple_connections_get_all(), gc))
+        return false;
+    return !get_data(gc).is_closing();
+}
+
+#endif
+
+} // End of anonymous namespace
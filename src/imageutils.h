@@ -0,0 +1,18 @@
+// Decoding and downscaling images off the main thread.
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+
+// Called with the image data, either scaled or the original one.
+typedef function_ptr<void(const char* data, size_t size)> ScaledImageCb;
+
+// Decodes the image on a worker thread and downscales it to fit into max_size x max_size box
+// preserving the aspect ratio. Images, which already fit or could not be decoded, are returned
+// as is, as are all images if max_size is zero or less or the plugin is built without gdk-pixbuf.
+// The callback is called in the main thread and is not called if the connection has been closed
+// in the meantime.
+void scale_image_async(PurpleConnection* gc, const char* data, size_t size, int max_size,
+                       const ScaledImageCb& callback);
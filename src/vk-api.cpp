@@ -36,6 +36,8 @@ void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams
         vkcom_debug_error("Programming error: API method %s called during logout\n", method_name);
         return;
     }
+    if (dropped_in_replay(gc, method_name))
+        return;
 
     VkCall call;
     call.method_name = method_name;
@@ -51,15 +53,21 @@ void vk_call_api(PurpleConnection* gc, const char* method_name, const CallParams
         purple_http_request_set_contents(req, body.data(), body.length());
     }
 
-    http_request(gc, req, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
+    gc_data.api_calls_running++;
+    gc_data.last_api_call_time = steady_clock::now();
+    PurpleHttpConnection* http_conn = http_request(gc, req, [=](PurpleHttpConnection* conn,
+                                                                 PurpleHttpResponse* response) {
         // Connection has been cancelled due to account being disconnected. Do not do any response
         // processing, as callbacks may initiate new HTTP requests.
         if (get_data(gc).is_closing())
             return;
 
-        on_vk_call_cb(http_conn, response, call, success_cb, error_cb);
+        get_data(gc).api_calls_running--;
+        on_vk_call_cb(conn, response, call, success_cb, error_cb);
     });
     purple_http_request_unref(req);
+    if (!http_conn)
+        gc_data.api_calls_running--;
 }
 
 namespace
@@ -0,0 +1,209 @@
+#include <algorithm>
+
+#include "miscutils.h"
+#include "vk-api.h"
+#include "vk-common.h"
+#include "vk-message-recv.h"
+
+#include "vk-backfill.h"
+
+namespace
+{
+
+// The interval between checks whether the next page can be requested (in msec).
+const unsigned BACKFILL_TICK_INTERVAL = 2000;
+// The next page is requested only if no API calls have been made during this time (in msec).
+const unsigned BACKFILL_IDLE_TIME = 3000;
+// The maximum number of messages, returned by messages.getHistory and dialogs, returned by
+// messages.getDialogs.
+const uint64 BACKFILL_PAGE_SIZE = 200;
+
+// Returns true if the next page can be requested without delaying anything else.
+bool backfill_can_proceed(PurpleConnection* gc);
+// Requests either the next page of dialogs list or the next page of history.
+void backfill_next_page(PurpleConnection* gc);
+// Requests the next page of dialogs and adds new dialogs to the queue.
+void backfill_list_dialogs(PurpleConnection* gc);
+// Requests the next page of history for the first dialog in the queue and writes it to logs.
+void backfill_dialog(PurpleConnection* gc);
+// Stops the download until it is started again after reconnecting or on the next login.
+void stop_history_backfill(PurpleConnection* gc, const char* reason);
+
+} // End of anonymous namespace
+
+void start_history_backfill(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    VkBackfillState& state = gc_data.backfill;
+    if (state.running || state.start_msg_id <= 1 || gc_data.options().backfill_messages_per_dialog <= 0)
+        return;
+
+    vkcom_debug_info("Starting history download for messages before %llu\n",
+                     (unsigned long long)state.start_msg_id);
+    state.running = true;
+    state.request_running = false;
+    state.queue.clear();
+    state.dialogs_offset = 0;
+    state.dialogs_listed = false;
+
+    timeout_add(gc, BACKFILL_TICK_INTERVAL, [=] {
+        VkBackfillState& current = get_data(gc).backfill;
+        if (!current.running)
+            return false;
+        if (!current.request_running && backfill_can_proceed(gc))
+            backfill_next_page(gc);
+        return current.running;
+    });
+}
+
+namespace
+{
+
+bool backfill_can_proceed(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.is_authenticating() || gc_data.long_poll.down || gc_data.api_calls_running > 0)
+        return false;
+    return to_milliseconds(steady_clock::now() - gc_data.last_api_call_time) >= BACKFILL_IDLE_TIME;
+}
+
+void backfill_next_page(PurpleConnection* gc)
+{
+    VkBackfillState& state = get_data(gc).backfill;
+    // Dialogs are listed lazily: the first page contains the most recent dialogs, which are
+    // downloaded before the rest are listed.
+    if (state.queue.empty() && !state.dialogs_listed) {
+        backfill_list_dialogs(gc);
+    } else if (!state.queue.empty()) {
+        backfill_dialog(gc);
+    } else {
+        vkcom_debug_info("History download finished\n");
+        state.running = false;
+    }
+}
+
+void backfill_list_dialogs(PurpleConnection* gc)
+{
+    VkBackfillState& state = get_data(gc).backfill;
+    state.request_running = true;
+    CallParams params = { {"count", to_string(BACKFILL_PAGE_SIZE)},
+                          {"offset", to_string(state.dialogs_offset)},
+                          {"preview_length", "1"} };
+    vk_call_api(gc, "messages.getDialogs", params, [=](const picojson::value& v) {
+        if (!field_is_present<double>(v, "count") || !field_is_present<picojson::array>(v, "items")) {
+            vkcom_debug_error("Strange response from messages.getDialogs: %s\n", v.serialize().data());
+            stop_history_backfill(gc, "strange response from messages.getDialogs");
+            return;
+        }
+
+        VkBackfillState& current = get_data(gc).backfill;
+        current.request_running = false;
+        const picojson::array& items = v.get("items").get<picojson::array>();
+        for (const picojson::value& item: items) {
+            if (!field_is_present<picojson::object>(item, "message"))
+                continue;
+            const picojson::value& message = item.get("message");
+            uint64 peer_id;
+            if (field_is_present<double>(message, "chat_id"))
+                peer_id = CHAT_ID_OFFSET + (uint64)message.get("chat_id").get<double>();
+            else if (field_is_present<double>(message, "user_id"))
+                peer_id = message.get("user_id").get<double>();
+            else
+                continue;
+
+            auto it = current.cursors.find(peer_id);
+            if (it == current.cursors.end())
+                it = current.cursors.insert({ peer_id, { current.start_msg_id, 0 } }).first;
+            if (it->second.before_msg_id != 0)
+                current.queue.push_back(peer_id);
+        }
+
+        current.dialogs_offset += items.size();
+        if (items.empty() || current.dialogs_offset >= v.get("count").get<double>())
+            current.dialogs_listed = true;
+    }, [=](const picojson::value&) {
+        stop_history_backfill(gc, "messages.getDialogs failed");
+    });
+}
+
+void backfill_dialog(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    VkBackfillState& state = gc_data.backfill;
+    uint64 peer_id = state.queue.front();
+    state.queue.pop_front();
+    const VkBackfillCursor& cursor = state.cursors[peer_id];
+    uint64 before_msg_id = cursor.before_msg_id;
+    uint64 limit = gc_data.options().backfill_messages_per_dialog;
+    uint64 count = std::min(BACKFILL_PAGE_SIZE, limit - std::min(limit, cursor.downloaded));
+
+    state.request_running = true;
+    CallParams params = { {"peer_id", to_string(peer_id)},
+                          {"start_message_id", to_string(before_msg_id - 1)},
+                          {"count", to_string(count)} };
+    vk_call_api(gc, "messages.getHistory", params, [=](const picojson::value& v) {
+        if (!field_is_present<picojson::array>(v, "items")) {
+            vkcom_debug_error("Strange response from messages.getHistory: %s\n", v.serialize().data());
+            stop_history_backfill(gc, "strange response from messages.getHistory");
+            return;
+        }
+
+        // Items are ordered from the newest one, the logs must be written from the oldest one.
+        picojson::array items;
+        const picojson::array& page = v.get("items").get<picojson::array>();
+        for (auto it = page.rbegin(); it != page.rend(); ++it) {
+            if (!field_is_present<double>(*it, "id") || it->get("id").get<double>() >= before_msg_id)
+                continue;
+            items.push_back(*it);
+            // process_message distinguishes chat messages by chat_id.
+            if (peer_id >= CHAT_ID_OFFSET && !items.back().contains("chat_id"))
+                items.back().get<picojson::object>()["chat_id"] =
+                    picojson::value(double(peer_id - CHAT_ID_OFFSET));
+        }
+
+        if (items.empty()) {
+            vkcom_debug_info("History for %llu has been downloaded\n", (unsigned long long)peer_id);
+            VkBackfillState& current = get_data(gc).backfill;
+            current.cursors[peer_id].before_msg_id = 0;
+            current.request_running = false;
+            return;
+        }
+
+        uint64 oldest_msg_id = items.front().get("id").get<double>();
+        size_t items_size = items.size();
+        receive_history_messages(gc, items, [=] {
+            // The cursor is moved only after the messages have been written, so that nothing
+            // is lost if the connection closes in the meantime.
+            VkBackfillState& current = get_data(gc).backfill;
+            VkBackfillCursor& current_cursor = current.cursors[peer_id];
+            current_cursor.before_msg_id = oldest_msg_id;
+            current_cursor.downloaded += items_size;
+            if (current_cursor.downloaded >= limit || items_size < count || oldest_msg_id <= 1)
+                current_cursor.before_msg_id = 0;
+            else
+                current.queue.push_back(peer_id);
+            current.request_running = false;
+        });
+    }, [=](const picojson::value& error) {
+        // Network errors are transient, but errors, returned by Vk.com (e.g. when the user has been
+        // removed from the chat), will most likely repeat.
+        if (error.is<picojson::null>()) {
+            stop_history_backfill(gc, "messages.getHistory failed");
+            return;
+        }
+        vkcom_debug_error("Unable to download history for %llu, skipping it\n", (unsigned long long)peer_id);
+        VkBackfillState& current = get_data(gc).backfill;
+        current.cursors[peer_id].before_msg_id = 0;
+        current.request_running = false;
+    });
+}
+
+void stop_history_backfill(PurpleConnection* gc, const char* reason)
+{
+    vkcom_debug_error("Stopping history download: %s\n", reason);
+    VkBackfillState& state = get_data(gc).backfill;
+    state.running = false;
+    state.request_running = false;
+}
+
+} // End of anonymous namespace
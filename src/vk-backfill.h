@@ -0,0 +1,17 @@
+// Downloading older history to logs in background.
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+
+// When the account logs in for the first time, only the last messages are received (see
+// receive_messages_range). The older history is downloaded later, one page of one dialog at a time,
+// only when no other API calls have been made for a while and Long Poll is up, so that it never
+// delays the messages the user is waiting for. The progress for each dialog is stored in account
+// settings, so the download continues where it stopped after the next login.
+//
+// Must be called after the initial synchronization, subsequent calls do nothing while the download
+// is running.
+void start_history_backfill(PurpleConnection* gc);
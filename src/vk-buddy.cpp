@@ -1,3 +1,6 @@
+#include <algorithm>
+
+#include "httpcache.h"
 #include "httputils.h"
 #include "miscutils.h"
 #include "vk-api.h"
@@ -53,6 +56,7 @@ void update_user_info_from(PurpleConnection* gc, const picojson::value& fields)
         return;
     }
     uint64 user_id = fields.get("id").get<double>();
+    invalidate_user_names(gc, user_id);
 
     VkUserInfo& info = get_data(gc).user_infos[user_id];
     info.real_name = fields.get("first_name").get<string>() + " " + fields.get("last_name").get<string>();
@@ -450,6 +454,9 @@ const char* get_user_status(const VkUserInfo& user_info)
 // libnotify shows notification).
 void update_buddy_presence_impl(PurpleConnection* gc, const string& buddy_name, const VkUserInfo& info)
 {
+    if (dropped_in_replay(gc, "purple_prpl_got_user_status"))
+        return;
+
     PurpleAccount* account = purple_connection_get_account(gc);
     PurpleBuddy* buddy = purple_find_buddy(account, buddy_name.data());
     if (!buddy)
@@ -474,10 +481,15 @@ struct FetchBuddyIcon
 };
 
 vector<FetchBuddyIcon> fetch_queue;
-// Number of currently running HTTP requests.
-int fetches_running = 0;
+// Connections, which run the currently running HTTP requests, one entry per request. The callbacks
+// of the requests are not called once their connection is closed, so the connection's entries are
+// removed in cancel_buddy_icon_fetches.
+vector<PurpleConnection*> fetches_running;
 // Maximum number of concurrently running HTTP requests
-const int MAX_FETCHES_RUNNING = 4;
+const size_t MAX_FETCHES_RUNNING = 4;
+// Set while start_buddy_icon_fetches is running. Cached icons are returned immediately, so we
+// must not start next fetches from the callback recursively.
+bool starting_fetches = false;
 
 string get_filename(const char* url)
 {
@@ -486,44 +498,55 @@ string get_filename(const char* url)
     return ret;
 }
 
+void start_buddy_icon_fetches();
+
 void fetch_next_buddy_icon()
 {
     FetchBuddyIcon fetch = fetch_queue.back();
     fetch_queue.pop_back();
-    fetches_running++;
+    fetches_running.push_back(fetch.gc);
     vkcom_debug_info("Load buddy icon from %s\n", fetch.icon_url.data());
-    http_get(fetch.gc, fetch.icon_url, [=](PurpleHttpConnection* http_conn, PurpleHttpResponse* response) {
+    http_get_cached(fetch.gc, fetch.icon_url, [=](const char* icon_data, size_t icon_len) {
         vkcom_debug_info("Updating buddy icon for %s\n", fetch.buddy_name.data());
-        if (!purple_http_response_is_successful(response)) {
-            vkcom_debug_error("Error while fetching buddy icon: %s\n",
-                               purple_http_response_get_error(response));
+        if (!icon_data) {
+            vkcom_debug_error("Error while fetching buddy icon\n");
         } else {
-            size_t icon_len;
-            const void* icon_data = purple_http_response_get_data(response, &icon_len);
-            const char* icon_url = purple_http_request_get_url(purple_http_conn_get_request(http_conn));
             // This should be synchronized with code in update_buddy_in_blist.
-            string checksum = get_filename(icon_url);
+            string checksum = get_filename(fetch.icon_url.data());
             purple_buddy_icons_set_for_user(purple_connection_get_account(fetch.gc), fetch.buddy_name.data(),
                                             g_memdup(icon_data, icon_len), icon_len, checksum.data());
         }
 
-        fetches_running--;
-        if (!fetch_queue.empty())
-            fetch_next_buddy_icon();
+        auto it = std::find(fetches_running.begin(), fetches_running.end(), fetch.gc);
+        if (it != fetches_running.end())
+            fetches_running.erase(it);
+        start_buddy_icon_fetches();
     });
 }
 
+void start_buddy_icon_fetches()
+{
+    if (starting_fetches)
+        return;
+    starting_fetches = true;
+    while (fetches_running.size() < MAX_FETCHES_RUNNING && !fetch_queue.empty())
+        fetch_next_buddy_icon();
+    starting_fetches = false;
+}
+
 // Starts downloading buddy icon and sets it upon finishing.
 void fetch_buddy_icon(PurpleConnection* gc, const string& buddy_name, const string& icon_url)
 {
     fetch_queue.push_back(FetchBuddyIcon{ gc, buddy_name, icon_url });
-    if (fetches_running < MAX_FETCHES_RUNNING)
-        fetch_next_buddy_icon();
+    start_buddy_icon_fetches();
 }
 
 // Adds or updates blist node for user_id.
 void update_blist_buddy(PurpleConnection* gc, uint64 user_id, const VkUserInfo& info)
 {
+    if (dropped_in_replay(gc, "update_blist_buddy"))
+        return;
+
     PurpleAccount* account = purple_connection_get_account(gc);
     string buddy_name = user_name_from_id(user_id);
     PurpleBuddy* buddy = purple_find_buddy(account, buddy_name.data());
@@ -567,6 +590,9 @@ void update_blist_buddy(PurpleConnection* gc, uint64 user_id, const VkUserInfo&
         }
     }
 
+    // The alias could have changed or the buddy could have been added.
+    invalidate_user_names(gc, user_id);
+
     // Store current alias/group information to check if it changed later.
     VkBlistNode& node = gc_data.blist_buddies[user_id];
     node.alias = purple_buddy_get_alias(buddy);
@@ -599,14 +625,21 @@ void update_blist_buddy(PurpleConnection* gc, uint64 user_id, const VkUserInfo&
 // Removes buddy from blist.
 void remove_blist_buddy(PurpleConnection* gc, PurpleBuddy* buddy, uint64 user_id)
 {
+    if (dropped_in_replay(gc, "purple_blist_remove_buddy"))
+        return;
+
     vkcom_debug_info("Removing %s from buddy list\n", purple_buddy_get_name(buddy));
     get_data(gc).blist_buddies.erase(user_id);
     purple_blist_remove_buddy(buddy);
+    invalidate_user_names(gc, user_id);
 }
 
 // Adds or updates blist node for chat_id.
 void update_blist_chat(PurpleConnection* gc, uint64 chat_id, const VkChatInfo& info)
 {
+    if (dropped_in_replay(gc, "update_blist_chat"))
+        return;
+
     PurpleAccount* account = purple_connection_get_account(gc);
 
     PurpleChat* chat = find_purple_chat_by_id(gc, chat_id);
@@ -661,6 +694,9 @@ void update_blist_chat(PurpleConnection* gc, uint64 chat_id, const VkChatInfo& i
 // Removes chat from blist.
 void remove_blist_chat(PurpleConnection* gc, PurpleChat* chat, uint64 chat_id)
 {
+    if (dropped_in_replay(gc, "purple_blist_remove_chat"))
+        return;
+
     vkcom_debug_info("Removing chat%llu from buddy list\n", (unsigned long long)chat_id);
     get_data(gc).blist_chats.erase(chat_id);
     purple_blist_remove_chat(chat);
@@ -1223,3 +1259,15 @@ void check_blist_on_logout(PurpleConnection* gc)
         check_customized_chat(gc, chat_id, chat, node);
     }
 }
+
+void cancel_buddy_icon_fetches(PurpleConnection* gc)
+{
+    erase_if(fetch_queue, [=](const FetchBuddyIcon& fetch) {
+        return fetch.gc == gc;
+    });
+    erase_if(fetches_running, [=](PurpleConnection* fetch_gc) {
+        return fetch_gc == gc;
+    });
+    // Other accounts may wait for the slots.
+    start_buddy_icon_fetches();
+}
@@ -76,3 +76,7 @@ void check_blist_on_login(PurpleConnection* gc);
 // Checks if user has manually changed alias and/or group for any of blist items (users or chats) and
 // adds appropriate tags (custom-group and custom-alias). Must be called upon logout.
 void check_blist_on_logout(PurpleConnection* gc);
+
+// Drops buddy icons, which are being downloaded for gc, and frees their download slots for other
+// accounts. Must be called upon closing connection.
+void cancel_buddy_icon_fetches(PurpleConnection* gc);
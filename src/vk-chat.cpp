@@ -116,10 +116,12 @@ void open_chat_conv(PurpleConnection* gc, uint64 chat_id, const SuccessCb& succe
 
         string name = chat_name_from_id(chat_id);
         int conv_id = add_new_conv_id(gc, chat_id);
-        PurpleConversation* conv = serv_got_joined_chat(gc, conv_id, name.data());
-        vkcom_debug_info("Added chat conversation %d for %s\n", conv_id, name.data());
+        if (!dropped_in_replay(gc, "serv_got_joined_chat")) {
+            PurpleConversation* conv = serv_got_joined_chat(gc, conv_id, name.data());
+            vkcom_debug_info("Added chat conversation %d for %s\n", conv_id, name.data());
 
-        update_open_chat_conv_impl(gc, conv, chat_id);
+            update_open_chat_conv_impl(gc, conv, chat_id);
+        }
 
         if (success_cb)
             success_cb();
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 
 #include <plugin.h>
@@ -30,47 +31,65 @@ set<uint64> str_split_int(const char* str)
     return ret;
 }
 
-// Parses VkReceivedMessages from JSON representation.
-vector<VkReceivedMessage> deferred_mark_as_read_from_string(const char* str)
+// Parses deferred message ids from JSON representation: an object, mapping peer ids to arrays
+// of message ids.
+map<uint64, vector<uint64>> deferred_mark_as_read_from_string(const char* str)
 {
-    vector<VkReceivedMessage> messages;
+    map<uint64, vector<uint64>> messages;
 
     picojson::value v;
     string err = picojson::parse(v, str, str + strlen(str));
-    if (!err.empty() || !v.is<picojson::array>()) {
-        vkcom_debug_error("Error loading uploaded docs: %s\n", err.data());
+    if (!err.empty()) {
+        vkcom_debug_error("Error loading deferred messages: %s\n", err.data());
         return messages;
     }
 
-    const picojson::array& a = v.get<picojson::array>();
-    for (const picojson::value& d: a) {
-        VkReceivedMessage msg;
-        msg.msg_id = d.get("msg_id").get<double>();
-        msg.user_id = d.get("user_id").get<double>();
-        msg.chat_id = d.get("chat_id").get<double>();
-        messages.push_back(std::move(msg));
+    size_t count = 0;
+    if (v.is<picojson::array>()) {
+        // Compatibility with older releases, which stored an array of {msg_id, user_id, chat_id}.
+        for (const picojson::value& d: v.get<picojson::array>()) {
+            if (!field_is_present<double>(d, "msg_id") || !field_is_present<double>(d, "user_id")
+                    || !field_is_present<double>(d, "chat_id"))
+                continue;
+            uint64 peer_id = peer_id_from_ids(d.get("user_id").get<double>(), d.get("chat_id").get<double>());
+            messages[peer_id].push_back(d.get("msg_id").get<double>());
+            count++;
+        }
+    } else if (v.is<picojson::object>()) {
+        for (const pair<const string, picojson::value>& p: v.get<picojson::object>()) {
+            if (!p.second.is<picojson::array>())
+                continue;
+            uint64 peer_id = atoll(p.first.data());
+            for (const picojson::value& id: p.second.get<picojson::array>()) {
+                if (!id.is<double>())
+                    continue;
+                messages[peer_id].push_back(id.get<double>());
+                count++;
+            }
+        }
     }
 
-    vkcom_debug_info("%d messages marked as unread\n", (int)messages.size());
+    vkcom_debug_info("%d messages marked as unread\n", (int)count);
 
     return messages;
 }
 
-// Stores VkReceivedMessages in JSON representation.
-string deferred_mark_as_read_to_string(const vector<VkReceivedMessage>& messages)
+// Stores deferred message ids in JSON representation.
+string deferred_mark_as_read_to_string(const map<uint64, vector<uint64>>& messages)
 {
-    vkcom_debug_info("%d messages still marked as unread\n", (int)messages.size());
-
-    picojson::array a;
-    for (const VkReceivedMessage& msg: messages) {
-        picojson::object d = {
-            {"msg_id",  picojson::value((double)msg.msg_id)},
-            {"user_id", picojson::value((double)msg.user_id)},
-            {"chat_id", picojson::value((double)msg.chat_id)},
-        };
-        a.push_back(picojson::value(d));
+    size_t count = 0;
+    picojson::object o;
+    for (const pair<const uint64, vector<uint64>>& p: messages) {
+        picojson::array ids;
+        for (uint64 id: p.second)
+            ids.push_back(picojson::value((double)id));
+        count += ids.size();
+        o[to_string(p.first)] = picojson::value(ids);
     }
-    return picojson::value(a).serialize();
+
+    vkcom_debug_info("%d messages still marked as unread\n", (int)count);
+
+    return picojson::value(o).serialize();
 }
 
 // Parses VkUploadedDocs from JSON representation.
@@ -122,6 +141,47 @@ string uploaded_docs_to_string(const map<uint64, VkUploadedDocInfo>& docs)
     return picojson::value(a).serialize();
 }
 
+// Parses VkBackfillCursors from JSON representation.
+map<uint64, VkBackfillCursor> backfill_cursors_from_string(const char* str)
+{
+    map<uint64, VkBackfillCursor> cursors;
+
+    picojson::value v;
+    string err = picojson::parse(v, str, str + strlen(str));
+    if (!err.empty() || !v.is<picojson::array>()) {
+        vkcom_debug_error("Error loading backfill cursors: %s\n", err.data());
+        return cursors;
+    }
+
+    const picojson::array& a = v.get<picojson::array>();
+    for (const picojson::value& d: a) {
+        if (!field_is_present<double>(d, "peer_id") || !field_is_present<double>(d, "before_msg_id")
+                || !field_is_present<double>(d, "downloaded"))
+            continue;
+
+        uint64 peer_id = d.get("peer_id").get<double>();
+        VkBackfillCursor& cursor = cursors[peer_id];
+        cursor.before_msg_id = d.get("before_msg_id").get<double>();
+        cursor.downloaded = d.get("downloaded").get<double>();
+    }
+    return cursors;
+}
+
+// Stores VkBackfillCursors in JSON representation.
+string backfill_cursors_to_string(const map<uint64, VkBackfillCursor>& cursors)
+{
+    picojson::array a;
+    for (const pair<const uint64, VkBackfillCursor>& p: cursors) {
+        picojson::object d = {
+            {"peer_id", picojson::value((double)p.first)},
+            {"before_msg_id", picojson::value((double)p.second.before_msg_id)},
+            {"downloaded", picojson::value((double)p.second.downloaded)}
+        };
+        a.push_back(picojson::value(d));
+    }
+    return picojson::value(a).serialize();
+}
+
 // Try to find plugin which has "webkit" in id.
 PurplePlugin* find_plugin_with_webkit_id()
 {
@@ -152,8 +212,14 @@ bool check_if_webkit_enabled()
 } // End of anonymous namespace
 
 VkData::VkData(PurpleConnection* gc, const string& email, const string& password)
-    : m_email(email),
+    : long_poll(),
+      replay_sink(nullptr),
+      api_calls_running(0),
+      backfill(),
+      mark_as_read_timer_running(false),
+      m_email(email),
       m_password(password),
+      m_sent_msgs_timer_running(false),
       m_gc(gc),
       m_closing(false),
       m_keepalive_pool(nullptr)
@@ -177,6 +243,12 @@ VkData::VkData(PurpleConnection* gc, const string& email, const string& password
     m_options.mark_as_read_replying_only = purple_account_get_bool(account, "mark_as_read_replying_only",
                                                                    false);
     m_options.imitate_mobile_client = purple_account_get_bool(account, "imitate_mobile_client", false);
+    m_options.long_poll_journal = purple_account_get_bool(account, "long_poll_journal", false);
+    m_options.thumbnail_downloads_per_host = purple_account_get_int(account, "thumbnail_downloads_per_host", 4);
+    m_options.thumbnail_max_size = purple_account_get_int(account, "thumbnail_max_size", 320);
+    m_options.backfill_messages_per_dialog = purple_account_get_int(account, "backfill_messages_per_dialog",
+                                                                    1000);
+    m_options.recent_messages_on_open = purple_account_get_int(account, "recent_messages_on_open", 10);
     m_options.blist_default_group = purple_account_get_string(account, "blist_default_group", "");
     m_options.blist_chat_group = purple_account_get_string(account, "blist_chat_group", "");
 
@@ -194,15 +266,34 @@ VkData::VkData(PurpleConnection* gc, const string& email, const string& password
 
     str = purple_account_get_string(account, "deferred_mark_as_read", "");
     deferred_mark_as_read = deferred_mark_as_read_from_string(str);
+    for (const pair<const uint64, vector<uint64>>& p: deferred_mark_as_read)
+        unread_messages[p.first].insert(p.second.begin(), p.second.end());
 
     str = purple_account_get_string(account, "uploaded_docs", "[]");
     uploaded_docs = uploaded_docs_from_string(str);
 
+    backfill.start_msg_id = atoll(purple_account_get_string(account, "backfill_start_msg_id", "0"));
+    str = purple_account_get_string(account, "backfill_cursors", "[]");
+    backfill.cursors = backfill_cursors_from_string(str);
+
     m_options.enable_webkit_workarounds = check_if_webkit_enabled();
 }
 
 VkData::~VkData()
 {
+    // g_source_remove calls timeout_destroy_cb, which modifies timeout_ids, so we make a copy before
+    // calling g_source_remove. Damned mutability.
+    set<unsigned> timeout_ids_copy = timeout_ids;
+    for (unsigned id: timeout_ids_copy)
+        g_source_remove(id);
+
+    if (m_keepalive_pool)
+        purple_http_keepalive_pool_unref(m_keepalive_pool);
+
+    // The sandbox, in which Long Poll journal is replayed, must not overwrite the account settings.
+    if (replay_sink)
+        return;
+
     PurpleAccount* account = purple_connection_get_account(m_gc);
 
     purple_account_set_string(account, "access_token_permissions", VK_PERMISSIONS);
@@ -221,20 +312,18 @@ VkData::~VkData()
     str = str_concat_int(',', m_manually_removed_chats);
     purple_account_set_string(account, "manually_removed_chats", str.data());
 
+    // The messages, which have not been marked as read yet, will be marked next time.
+    for (const pair<const uint64, vector<uint64>>& p: pending_mark_as_read)
+        append(deferred_mark_as_read[p.first], p.second);
     str = deferred_mark_as_read_to_string(deferred_mark_as_read);
     purple_account_set_string(account, "deferred_mark_as_read", str.data());
 
     str = uploaded_docs_to_string(uploaded_docs);
     purple_account_set_string(account, "uploaded_docs", str.data());
 
-    // g_source_remove calls timeout_destroy_cb, which modifies timeout_ids, so we make a copy before
-    // calling g_source_remove. Damned mutability.
-    set<unsigned> timeout_ids_copy = timeout_ids;
-    for (unsigned id: timeout_ids_copy)
-        g_source_remove(id);
-
-    if (m_keepalive_pool)
-        purple_http_keepalive_pool_unref(m_keepalive_pool);
+    purple_account_set_string(account, "backfill_start_msg_id", to_string(backfill.start_msg_id).data());
+    str = backfill_cursors_to_string(backfill.cursors);
+    purple_account_set_string(account, "backfill_cursors", str.data());
 }
 
 void VkData::authenticate(const SuccessCb& success_cb, const ErrorCb& error_cb)
@@ -282,6 +371,139 @@ PurpleHttpKeepalivePool* VkData::get_keepalive_pool()
     return m_keepalive_pool;
 }
 
+namespace
+{
+
+// Locally sent messages and unmatched outgoing echoes are kept for this long.
+const int SENT_MSG_TIMEOUT = 30000;
+// Interval between checks for stale entries.
+const int SENT_MSG_CHECK_INTERVAL = 5000;
+
+} // End of anonymous namespace
+
+uint64 VkData::add_sent_msg()
+{
+    // random_id is a signed 32-bit integer in Vk.com API. Zero means "no random_id".
+    uint64 random_id;
+    do {
+        random_id = g_random_int_range(1, G_MAXINT32);
+    } while (std::any_of(m_sent_msgs.begin(), m_sent_msgs.end(), [=](const SentMessage& msg) {
+        return msg.random_id == random_id;
+    }));
+
+    m_sent_msgs.push_back({ random_id, 0, steady_clock::now() });
+    start_sent_msgs_timer();
+    return random_id;
+}
+
+void VkData::set_sent_msg_id(uint64 random_id, uint64 msg_id)
+{
+    auto msg_it = std::find_if(m_sent_msgs.begin(), m_sent_msgs.end(), [=](const SentMessage& msg) {
+        return msg.random_id == random_id;
+    });
+    // The message could have been matched by random_id or evicted.
+    if (msg_it == m_sent_msgs.end())
+        return;
+
+    auto echo_it = std::find_if(m_outgoing_echoes.begin(), m_outgoing_echoes.end(),
+                                [=](const OutgoingEcho& echo) {
+        return echo.msg_id == msg_id;
+    });
+    if (echo_it != m_outgoing_echoes.end()) {
+        m_outgoing_echoes.erase(echo_it);
+        m_sent_msgs.erase(msg_it);
+    } else {
+        msg_it->msg_id = msg_id;
+    }
+
+    flush_outgoing_echoes();
+}
+
+void VkData::remove_sent_msg(uint64 random_id)
+{
+    erase_if(m_sent_msgs, [=](const SentMessage& msg) {
+        return msg.random_id == random_id;
+    });
+    flush_outgoing_echoes();
+}
+
+void VkData::process_outgoing_echo(uint64 msg_id, uint64 random_id, const SuccessCb& process_cb)
+{
+    auto msg_it = std::find_if(m_sent_msgs.begin(), m_sent_msgs.end(), [=](const SentMessage& msg) {
+        return (random_id != 0 && msg.random_id == random_id) || (msg.msg_id != 0 && msg.msg_id == msg_id);
+    });
+    // The message has been sent by us, ignore it. It may have been the last send in flight, so
+    // the echoes, which have been waiting for it, are processed now.
+    if (msg_it != m_sent_msgs.end()) {
+        m_sent_msgs.erase(msg_it);
+        flush_outgoing_echoes();
+        return;
+    }
+
+    bool send_in_flight = std::any_of(m_sent_msgs.begin(), m_sent_msgs.end(), [](const SentMessage& msg) {
+        return msg.msg_id == 0;
+    });
+    if (!send_in_flight) {
+        // This is fast path: the message is guaranteed to be sent from someplace else.
+        process_cb();
+        return;
+    }
+
+    vkcom_debug_info("We are sending a message right now, let's check msg id %llu after messages.send\n",
+                     (unsigned long long)msg_id);
+    m_outgoing_echoes.push_back({ msg_id, random_id, steady_clock::now(), process_cb });
+    start_sent_msgs_timer();
+}
+
+void VkData::flush_outgoing_echoes()
+{
+    bool send_in_flight = std::any_of(m_sent_msgs.begin(), m_sent_msgs.end(), [](const SentMessage& msg) {
+        return msg.msg_id == 0;
+    });
+    if (send_in_flight)
+        return;
+
+    deque<OutgoingEcho> echoes;
+    echoes.swap(m_outgoing_echoes);
+    for (const OutgoingEcho& echo: echoes)
+        echo.process_cb();
+}
+
+bool VkData::evict_sent_msgs()
+{
+    steady_time_point now = steady_clock::now();
+    while (!m_sent_msgs.empty() && to_milliseconds(now - m_sent_msgs.front().sent_time) >= SENT_MSG_TIMEOUT)
+        m_sent_msgs.pop_front();
+
+    while (!m_outgoing_echoes.empty()
+           && to_milliseconds(now - m_outgoing_echoes.front().received_time) >= SENT_MSG_TIMEOUT) {
+        OutgoingEcho echo = std::move(m_outgoing_echoes.front());
+        m_outgoing_echoes.pop_front();
+
+        vkcom_debug_error("We have sent a message not long ago, but not all"
+                          " msg id are belong to us (msg id %llu)\n", (unsigned long long)echo.msg_id);
+        echo.process_cb();
+    }
+    // Sends, which have been evicted, will never be matched, so the echoes need not wait for them.
+    flush_outgoing_echoes();
+
+    return !m_sent_msgs.empty() || !m_outgoing_echoes.empty();
+}
+
+void VkData::start_sent_msgs_timer()
+{
+    if (m_sent_msgs_timer_running || m_closing)
+        return;
+
+    m_sent_msgs_timer_running = true;
+    timeout_add(m_gc, SENT_MSG_CHECK_INTERVAL, [this] {
+        if (evict_sent_msgs())
+            return true;
+        m_sent_msgs_timer_running = false;
+        return false;
+    });
+}
+
 
 string user_name_from_id(uint64 user_id)
 {
@@ -340,6 +562,9 @@ void timeout_add(PurpleConnection* gc, unsigned milliseconds, const TimeoutCb& c
         vkcom_debug_error("Programming error: timeout_add(%d) called during logout\n", milliseconds);
         return;
     }
+    // The callback would run after the replayed events, outside of the sandbox.
+    if (dropped_in_replay(gc, "timeout_add"))
+        return;
 
     TimeoutCbData* data = new TimeoutCbData({ callback, gc_data, 0 });
     data->id = g_timeout_add_full(G_PRIORITY_DEFAULT, milliseconds, [](void* user_data) -> gboolean {
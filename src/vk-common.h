@@ -2,9 +2,11 @@
 
 #pragma once
 
+#include <deque>
 #include <map>
 #include <set>
 
+using std::deque;
 using std::map;
 using std::pair;
 using std::set;
@@ -26,6 +28,18 @@ struct VkOptions
     bool mark_as_read_replying_only;
     bool imitate_mobile_client;
     bool enable_webkit_workarounds;
+    bool long_poll_journal;
+    // Maximum number of simultaneous thumbnail downloads from one host.
+    int thumbnail_downloads_per_host;
+    // Thumbnails are downloaded in the biggest size, which fits into the box of this size (in pixels),
+    // the ones, which are bigger anyway, are downscaled to fit into it. Zero or less disables both.
+    // With the default 320, photos are downloaded as photo_130 and videos as photo_320.
+    int thumbnail_max_size;
+    // Maximum number of older messages per dialog, downloaded to logs in background. Zero disables
+    // the download.
+    int backfill_messages_per_dialog;
+    // Number of latest messages from the message store, shown when a conversation is opened.
+    int recent_messages_on_open;
     string blist_default_group;
     string blist_chat_group;
 };
@@ -68,8 +82,20 @@ struct VkUserInfo
     string photo_max;
 };
 
-// Message, describing one received message. This structure is used for saving received messages
-// until they must be marked as read.
+// Display names and hrefs, rendered from user infos and buddy list, see get_user_display_name et al.
+// Entries for the user are removed when the user info or the buddy changes.
+struct VkNameCache
+{
+    map<uint64, string> display_names;
+    map<uint64, string> unique_display_names;
+    map<uint64, string> user_hrefs;
+    // Account alias, which self_chat_display_name has been rendered from.
+    string self_alias;
+    string self_chat_display_name;
+};
+
+// Message, describing one received message. This structure is used for passing received messages
+// to mark_message_as_read.
 struct VkReceivedMessage
 {
     uint64 msg_id;
@@ -121,6 +147,87 @@ struct VkBlistNode
     string group;
 };
 
+class LogWriter;
+class LongPollJournal;
+class MessageSequencer;
+class MessageStore;
+class ReplaySink;
+class ThumbnailImages;
+
+// State of Long Poll connection, managed by vk-longpoll.cpp.
+struct VkLongPollState
+{
+    // Incremented for each Long Poll request. Responses to the requests, which have been abandoned
+    // by the watchdog, carry an older generation and are ignored.
+    unsigned generation;
+    // Currently running request (may be already finished, check with purple_http_conn_is_running).
+    PurpleHttpConnection* http_conn;
+    bool request_running;
+    steady_time_point request_time;
+
+    // GNetworkMonitor state.
+    bool network_available;
+    bool waiting_for_network;
+    unsigned long network_changed_handler;
+
+    // Reconnection state and metrics. down is set from the moment the connection is considered lost
+    // and until the first successful Long Poll response after reconnecting.
+    bool down;
+    steady_time_point down_since;
+    unsigned failed_reconnects;
+    unsigned reconnect_count;
+    steady_duration total_downtime;
+
+    // Callbacks, waiting for the messages since last_msg_id to be received upon (re)connecting.
+    // A reconnect during the synchronization does not start another one, which would receive
+    // and show the same messages again, but waits for the running one.
+    vector<function_ptr<void(uint64 max_msg_id)>> range_sync_cbs;
+
+    // Journal of raw responses, present only if long_poll_journal option is set.
+    shared_ptr<LongPollJournal> journal;
+};
+
+// Long Poll and messages.getHistory identify chats by chat_id + CHAT_ID_OFFSET instead of user id.
+const uint64 CHAT_ID_OFFSET = 2000000000LL;
+
+// Returns peer id, which identifies the dialog: user id for instant messages, chat_id + CHAT_ID_OFFSET
+// for chats.
+inline uint64 peer_id_from_ids(uint64 user_id, uint64 chat_id)
+{
+    return chat_id != 0 ? chat_id + CHAT_ID_OFFSET : user_id;
+}
+
+// Progress of downloading older history for one dialog.
+struct VkBackfillCursor
+{
+    // Messages with ids less than this are yet to be downloaded. Zero if the dialog has been
+    // downloaded fully or up to the limit.
+    uint64 before_msg_id;
+    // The number of messages, downloaded so far.
+    uint64 downloaded;
+};
+
+// State of background history download, managed by vk-backfill.cpp.
+struct VkBackfillState
+{
+    // Messages with ids less than this have not been received upon the first login. Zero if
+    // unknown (the account had been synchronized before), the history is not downloaded then.
+    uint64 start_msg_id;
+    // Cursors for all dialogs, which have been seen, keyed by peer id (user id or chat id +
+    // CHAT_ID_OFFSET).
+    map<uint64, VkBackfillCursor> cursors;
+
+    // The fields below are not stored.
+    bool running;
+    bool request_running;
+    // Peer ids of dialogs with unfinished cursors, downloaded in round-robin order.
+    deque<uint64> queue;
+    // Offset of the next page of messages.getDialogs. dialogs_listed is set when all pages
+    // have been received.
+    size_t dialogs_offset;
+    bool dialogs_listed;
+};
+
 // All timed events must be added via this timeout_add, because only then they will be properly
 // destroyed upon closing connection.
 typedef function_ptr<bool()> TimeoutCb;
@@ -189,49 +296,67 @@ public:
     // updated only when info is re-requested and is stale.
     map<uint64, VkGroupInfo> group_infos;
 
+    // Cached display names for users. Names in chats are cached in VkChatInfo::participants.
+    VkNameCache name_cache;
+
+    // Long Poll connection state, see vk-longpoll.cpp.
+    VkLongPollState long_poll;
+    // Set only in the sandbox, in which Long Poll journal is replayed, see vk-replay-sink.h.
+    ReplaySink* replay_sink;
+
+    // The number of API calls in flight and the time the last one has been made. Used by background
+    // jobs, which must not delay the calls made on behalf of the user.
+    unsigned api_calls_running;
+    steady_time_point last_api_call_time;
+
+    // Writer for messages, which are not shown in conversations, see vk-log-writer.h. Created upon
+    // first use by get_log_writer.
+    shared_ptr<LogWriter> log_writer;
+    // Local store of received and sent messages, see vk-message-store.h. Opened upon first use
+    // by get_message_store.
+    shared_ptr<MessageStore> message_store;
+    // Keeps the order of messages in conversations, see vk-message-sequencer.h. Created upon first
+    // use by get_message_sequencer.
+    shared_ptr<MessageSequencer> message_sequencer;
+    // imgstore images of received thumbnails, see vk-thumbnail-images.h. Created upon first use
+    // by get_thumbnail_images.
+    shared_ptr<ThumbnailImages> thumbnail_images;
+
+    // Background history download state, see vk-backfill.h. start_msg_id and cursors are loaded
+    // in VkData constructor and stored in destructor.
+    VkBackfillState backfill;
+
     // There is a problem with processing outgoing messages: either they are sent by us and need no further
     // processing, or they are sent by some other client (or from website) and we need to at least append
     // them to log. We can potentially receive response from messages.send *after* longpoll informs us
     // about them. The devised algorithm is as follows:
     //
-    // 1) Upon calling messages.send, m_last_msg_send_time is updated to the current time.
-    // 2) The returned mid from messages.send call is stored in m_sent_msg_ids.
-    // 3) When longpoll processes outgoing message with given mid, it checks m_sent_msg_ids if the message
-    //    has been sent by us. If received mid is not present in m_sent_msg_ids, it checks if the last message
-    //    has been sent by us earlier then 1 second. If it has not, after a 5 second timeout m_sent_msg_ids
-    //    is checked again (hopefully, by that time messages.send would have returned a message and the desured
-    //    mid will be in m_sent_msg_ids).
+    // 1) Before calling messages.send, add_sent_msg is called. It generates random_id, which is passed
+    //    to messages.send, and appends the message to m_sent_msgs, ordered by send time.
+    // 2) The returned mid from messages.send call is stored via set_sent_msg_id (or the entry is removed
+    //    via remove_sent_msg if sending failed).
+    // 3) When longpoll processes outgoing message, it calls process_outgoing_echo, which matches
+    //    the message against m_sent_msgs by random_id or mid. If there is no match and no messages.send
+    //    call is still in flight, the message has been sent from someplace else and is processed
+    //    immediately. Otherwise, it is put into m_outgoing_echoes until messages.send calls return.
+    // 4) A single timer evicts entries older than 30 seconds from both queues, processing the stale
+    //    echoes as sent from someplace else, so that the memory stays bounded.
     //
     // We only to *locally* sent messages.
 
-    // Adds sent msg id. Must be used when sending the message succeeds and we get the msg id.
-    void add_sent_msg_id(uint64 msg_id)
-    {
-        m_sent_msg_ids.insert(msg_id);
-    }
+    // Registers the message, which is about to be sent. Returns random_id, which must be passed
+    // to messages.send.
+    uint64 add_sent_msg();
 
-    // Checks if msg_id has been sent and removes it from the list of sent msg ids. Returns false
-    // if msg_id had not been sent, true otherwise.
-    bool remove_sent_msg_id(uint64 msg_id)
-    {
-        return m_sent_msg_ids.erase(msg_id) > 0;
-    }
+    // Sets msg id, returned by messages.send for the message with given random_id.
+    void set_sent_msg_id(uint64 random_id, uint64 msg_id);
 
-    // Returns send time of last locally sent message.
-    steady_time_point last_msg_sent_time() const
-    {
-        return m_last_msg_sent_time;
-    }
+    // Removes the message with given random_id. Must be used when messages.send fails.
+    void remove_sent_msg(uint64 random_id);
 
-    // Sets last message sent time. Must be used when sending the message.
-    void set_last_msg_sent_time(steady_time_point sent_time)
-    {
-        if (sent_time < m_last_msg_sent_time) {
-            vkcom_debug_error("Trying to set last sent time earlier than currently set time\n");
-            return;
-        }
-        m_last_msg_sent_time = sent_time;
-    }
+    // Checks if the outgoing message has been sent by us. If it has not, process_cb is called either
+    // immediately or after all currently running messages.send calls finish.
+    void process_outgoing_echo(uint64 msg_id, uint64 random_id, const SuccessCb& process_cb);
 
     // These two sets (manually_added_buddies and manually_removed_buddies) are updated when user selects
     // "Add buddy" or "Remove" in the buddy list. They are permanently stored in account properties,
@@ -287,10 +412,19 @@ public:
         m_manually_added_chats.erase(chat_id);
     }
 
-    // A collection of messages, which should be marked as read later (when user starts
-    // typing or activates tab or changes status to Available). Must be stored and loaded, so that
-    // we do not lose any read statuses.
-    vector<VkReceivedMessage> deferred_mark_as_read;
+    // Ids of messages, which should be marked as read later (when user starts typing or activates
+    // tab or changes status to Available), indexed by peer id, so that activating a conversation
+    // looks only at its own messages. Must be stored and loaded, so that we do not lose any read
+    // statuses.
+    map<uint64, vector<uint64>> deferred_mark_as_read;
+    // Ids of messages, which will be marked as read by the next coalesced messages.markAsRead call,
+    // indexed the same way. They are stored as deferred if the connection closes before the call.
+    map<uint64, vector<uint64>> pending_mark_as_read;
+    bool mark_as_read_timer_running;
+    // Ids of incoming messages, which are known to be unread, indexed by peer id. Filled with
+    // the messages, passed to mark_message_as_read (and the deferred ones upon login), and updated
+    // by Long Poll flag events, so that the messages, read on other clients, are not marked again.
+    map<uint64, set<uint64>> unread_messages;
 
     // We check this collection on each file xfer and update it after upload to Vk.com. It gets stored and loaded
     // from settings.
@@ -339,8 +473,32 @@ private:
 
     VkOptions m_options;
 
-    set<uint64> m_sent_msg_ids;
-    steady_time_point m_last_msg_sent_time;
+    // Helper structs for process_outgoing_echo. Both queues are ordered by time.
+    struct SentMessage
+    {
+        uint64 random_id;
+        // Zero until messages.send returns.
+        uint64 msg_id;
+        steady_time_point sent_time;
+    };
+    struct OutgoingEcho
+    {
+        uint64 msg_id;
+        uint64 random_id;
+        steady_time_point received_time;
+        SuccessCb process_cb;
+    };
+
+    deque<SentMessage> m_sent_msgs;
+    deque<OutgoingEcho> m_outgoing_echoes;
+    bool m_sent_msgs_timer_running;
+
+    // Processes all echoes if there are no messages.send calls in flight.
+    void flush_outgoing_echoes();
+    // Evicts stale entries from m_sent_msgs and m_outgoing_echoes, returns true if any entries remain.
+    bool evict_sent_msgs();
+    // Starts the eviction timer unless it is already running.
+    void start_sent_msgs_timer();
 
     set<uint64> m_manually_added_buddies;
     set<uint64> m_manually_removed_buddies;
@@ -362,6 +520,10 @@ inline VkData& get_data(PurpleConnection* gc)
     return *(VkData*)purple_connection_get_protocol_data(gc);
 }
 
+// Returns true if Long Poll journal is being replayed for gc, in which case the caller must not pass
+// anything to the server or libpurple. The dropped call is counted under what, see ReplaySink.
+bool dropped_in_replay(PurpleConnection* gc, const char* what);
+
 
 // Functions for converting buddy name (Pidgin) to/from user id (Vk.com).
 string user_name_from_id(uint64 user_id);
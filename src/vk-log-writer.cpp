@@ -0,0 +1,110 @@
+#include "vk-log-writer.h"
+
+namespace
+{
+
+// Buffered messages are written with this interval (in msec).
+const unsigned LOG_FLUSH_INTERVAL = 1000;
+// Logs, which have not been written to in this time, are closed (in seconds).
+const int LOG_IDLE_TIMEOUT = 60;
+
+} // End of anonymous namespace
+
+LogWriter::LogWriter(PurpleConnection* gc)
+    : m_gc(gc),
+      m_timer_running(false)
+{
+}
+
+LogWriter::~LogWriter()
+{
+    flush();
+    for (const pair<const LogKey, OpenLog>& p: m_logs)
+        purple_log_free(p.second.log);
+}
+
+void LogWriter::write(uint64 user_id, uint64 chat_id, PurpleMessageFlags flags, const string& from,
+                      time_t timestamp, const string& text, time_t log_time)
+{
+    if (dropped_in_replay(m_gc, "purple_log_write"))
+        return;
+    m_pending.push_back({ LogKey(peer_id_from_ids(user_id, chat_id), log_time), flags, from, timestamp, text });
+
+    if (m_timer_running)
+        return;
+    m_timer_running = true;
+    PurpleConnection* gc = m_gc;
+    timeout_add(m_gc, LOG_FLUSH_INTERVAL, [=] {
+        return get_log_writer(gc).on_timer();
+    });
+}
+
+void LogWriter::flush()
+{
+    if (m_pending.empty())
+        return;
+
+    steady_time_point now = steady_clock::now();
+    for (const PendingMessage& message: m_pending) {
+        OpenLog& open = m_logs[message.key];
+        if (!open.log)
+            open.log = open_log(message.key);
+        open.last_write = now;
+        purple_log_write(open.log, message.flags, message.from.data(), message.timestamp,
+                         message.text.data());
+    }
+    m_pending.clear();
+}
+
+void LogWriter::close_logs(uint64 peer_id)
+{
+    flush();
+
+    auto it = m_logs.lower_bound(LogKey(peer_id, 0));
+    while (it != m_logs.end() && it->first.first == peer_id) {
+        purple_log_free(it->second.log);
+        it = m_logs.erase(it);
+    }
+}
+
+bool LogWriter::on_timer()
+{
+    flush();
+
+    steady_time_point now = steady_clock::now();
+    for (auto it = m_logs.begin(); it != m_logs.end(); ) {
+        if (to_seconds(now - it->second.last_write) >= LOG_IDLE_TIMEOUT) {
+            purple_log_free(it->second.log);
+            it = m_logs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    m_timer_running = !m_logs.empty();
+    return m_timer_running;
+}
+
+PurpleLog* LogWriter::open_log(const LogKey& key)
+{
+    uint64 peer_id = key.first;
+    time_t log_time = key.second != 0 ? key.second : time(nullptr);
+    PurpleAccount* account = purple_connection_get_account(m_gc);
+    // Messages are written to logs only when no conversation is open, so no conversation is passed.
+    // It would not outlive the log anyway.
+    if (peer_id < CHAT_ID_OFFSET) {
+        string name = user_name_from_id(peer_id);
+        return purple_log_new(PURPLE_LOG_IM, name.data(), account, nullptr, log_time, nullptr);
+    } else {
+        string name = chat_name_from_id(peer_id - CHAT_ID_OFFSET);
+        return purple_log_new(PURPLE_LOG_CHAT, name.data(), account, nullptr, log_time, nullptr);
+    }
+}
+
+LogWriter& get_log_writer(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.log_writer)
+        gc_data.log_writer.reset(new LogWriter(gc));
+    return *gc_data.log_writer;
+}
@@ -0,0 +1,70 @@
+// Writing messages, which are not shown in conversations, to logs.
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+#include <log.h>
+
+#include "vk-common.h"
+
+// Long-lived per-account log writer. Logs are kept open between receive batches and Long Poll
+// events, so that an active dialog, which is not open in a conversation window, is written to one
+// log file instead of a new file for each message or batch. Messages are buffered and written
+// in batches from a timer, logs are closed when nothing has been written to them for a while.
+class LogWriter
+{
+public:
+    LogWriter(PurpleConnection* gc);
+    // Writes buffered messages and closes all logs.
+    ~LogWriter();
+
+    DISABLE_COPYING(LogWriter)
+
+    // Appends the message to the log for user_id or chat_id (either of the two must be zero).
+    // If log_time is not zero, the message is written to a separate log, which starts at log_time
+    // (used for older history, so that the logs are listed in the right order).
+    void write(uint64 user_id, uint64 chat_id, PurpleMessageFlags flags, const string& from,
+               time_t timestamp, const string& text, time_t log_time = 0);
+
+    // Writes all buffered messages.
+    void flush();
+
+    // Writes buffered messages and closes the logs for peer_id (user id or chat id + CHAT_ID_OFFSET).
+    // Must be called when a conversation for the peer is created: the conversation starts its own
+    // log and the logs are listed by their start time, so the messages, written to the log after
+    // that, would be shown before the conversation.
+    void close_logs(uint64 peer_id);
+
+private:
+    // Logs are identified by peer id (user id or chat id + CHAT_ID_OFFSET) and log_time.
+    typedef pair<uint64, time_t> LogKey;
+
+    struct OpenLog
+    {
+        PurpleLog* log;
+        steady_time_point last_write;
+    };
+    struct PendingMessage
+    {
+        LogKey key;
+        PurpleMessageFlags flags;
+        string from;
+        time_t timestamp;
+        string text;
+    };
+
+    PurpleConnection* m_gc;
+    vector<PendingMessage> m_pending;
+    map<LogKey, OpenLog> m_logs;
+    bool m_timer_running;
+
+    // Flushes buffered messages and closes idle logs. Returns false when there is nothing left
+    // to do and the timer must stop.
+    bool on_timer();
+    PurpleLog* open_log(const LogKey& key);
+};
+
+// Returns log writer for the account, creating it upon first use.
+LogWriter& get_log_writer(PurpleConnection* gc);
@@ -0,0 +1,364 @@
+#include <cstdlib>
+
+#include "vk-longpoll-decoder.h"
+
+namespace
+{
+
+bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// A minimal JSON scanner over [pos, end). It does not build any structures, only skips values
+// and reads numbers and string boundaries.
+class Scanner
+{
+public:
+    Scanner(const char* begin, const char* end)
+        : m_pos(begin),
+          m_end(end)
+    {
+    }
+
+    const char* pos() const
+    {
+        return m_pos;
+    }
+
+    // Skips whitespace and returns the next character or 0 if the input has ended.
+    char peek()
+    {
+        while (m_pos != m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n' || *m_pos == '\r'))
+            m_pos++;
+        return m_pos != m_end ? *m_pos : 0;
+    }
+
+    // Skips whitespace and consumes c if it is the next character.
+    bool consume(char c)
+    {
+        if (peek() != c)
+            return false;
+        m_pos++;
+        return true;
+    }
+
+    // Reads the string, m_pos must point to the opening quote. Sets [begin, end) to the string
+    // contents without quotes.
+    bool read_string(const char*& begin, const char*& end, bool& escaped)
+    {
+        if (!consume('"'))
+            return false;
+        begin = m_pos;
+        escaped = false;
+        while (m_pos != m_end) {
+            if (*m_pos == '"') {
+                end = m_pos;
+                m_pos++;
+                return true;
+            }
+            if (*m_pos == '\\') {
+                escaped = true;
+                m_pos++;
+                if (m_pos == m_end)
+                    return false;
+            }
+            m_pos++;
+        }
+        return false;
+    }
+
+    // Reads the number. Fractional part and exponent are skipped.
+    bool read_number(int64& number)
+    {
+        peek();
+        bool negative = false;
+        if (m_pos != m_end && *m_pos == '-') {
+            negative = true;
+            m_pos++;
+        }
+        if (m_pos == m_end || !is_digit(*m_pos))
+            return false;
+
+        uint64 value = 0;
+        while (m_pos != m_end && is_digit(*m_pos)) {
+            value = value * 10 + (*m_pos - '0');
+            m_pos++;
+        }
+        while (m_pos != m_end && (is_digit(*m_pos) || *m_pos == '.' || *m_pos == 'e' || *m_pos == 'E'
+                                  || *m_pos == '+' || *m_pos == '-'))
+            m_pos++;
+
+        number = negative ? -int64(value) : int64(value);
+        return true;
+    }
+
+    // Skips an object or an array, m_pos must point to the opening bracket.
+    bool skip_compound()
+    {
+        int depth = 0;
+        while (m_pos != m_end) {
+            char c = *m_pos;
+            if (c == '"') {
+                const char* begin;
+                const char* end;
+                bool escaped;
+                if (!read_string(begin, end, escaped))
+                    return false;
+                continue;
+            }
+            m_pos++;
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                depth--;
+                if (depth == 0)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Reads any value.
+    bool read_value(LongPollValue& value)
+    {
+        char c = peek();
+        value.number = 0;
+        value.escaped = false;
+        if (c == '"') {
+            value.type = LongPollValue::STRING;
+            return read_string(value.begin, value.end, value.escaped);
+        }
+
+        value.begin = m_pos;
+        bool ok;
+        if (c == '{') {
+            value.type = LongPollValue::OBJECT;
+            ok = skip_compound();
+        } else if (c == '[') {
+            value.type = LongPollValue::ARRAY;
+            ok = skip_compound();
+        } else if (c == '-' || is_digit(c)) {
+            value.type = LongPollValue::NUMBER;
+            ok = read_number(value.number);
+        } else if (c == 't' || c == 'f' || c == 'n') {
+            value.type = LongPollValue::LITERAL;
+            while (m_pos != m_end && *m_pos >= 'a' && *m_pos <= 'z')
+                m_pos++;
+            ok = true;
+        } else {
+            ok = false;
+        }
+        value.end = m_pos;
+        return ok;
+    }
+
+private:
+    const char* m_pos;
+    const char* m_end;
+};
+
+// Reads one update array.
+bool read_update(Scanner& scanner, LongPollUpdate& update)
+{
+    update.size = 0;
+    update.begin = scanner.pos();
+    if (!scanner.consume('['))
+        return false;
+
+    if (!scanner.consume(']')) {
+        do {
+            LongPollValue value;
+            if (!scanner.read_value(value))
+                return false;
+            if (update.size < LONG_POLL_MAX_FIELDS)
+                update.fields[update.size++] = value;
+        } while (scanner.consume(','));
+
+        if (!scanner.consume(']'))
+            return false;
+    }
+    update.end = scanner.pos();
+    return true;
+}
+
+// Appends code point as UTF-8.
+void append_utf8(string& str, unsigned code)
+{
+    if (code < 0x80) {
+        str += char(code);
+    } else if (code < 0x800) {
+        str += char(0xC0 | (code >> 6));
+        str += char(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        str += char(0xE0 | (code >> 12));
+        str += char(0x80 | ((code >> 6) & 0x3F));
+        str += char(0x80 | (code & 0x3F));
+    } else {
+        str += char(0xF0 | (code >> 18));
+        str += char(0x80 | ((code >> 12) & 0x3F));
+        str += char(0x80 | ((code >> 6) & 0x3F));
+        str += char(0x80 | (code & 0x3F));
+    }
+}
+
+// Unicode replacement character, written instead of malformed \u escapes and lone surrogates.
+const unsigned REPLACEMENT_CHARACTER = 0xFFFD;
+
+// Reads four hex digits at it and moves it past them. Returns false and leaves it intact if they
+// are not present.
+bool read_hex4(const char*& it, const char* end, unsigned& code)
+{
+    if (end - it < 4)
+        return false;
+    code = 0;
+    for (int i = 0; i < 4; i++) {
+        code <<= 4;
+        if (it[i] >= '0' && it[i] <= '9')
+            code |= it[i] - '0';
+        else if (it[i] >= 'a' && it[i] <= 'f')
+            code |= it[i] - 'a' + 10;
+        else if (it[i] >= 'A' && it[i] <= 'F')
+            code |= it[i] - 'A' + 10;
+        else
+            return false;
+    }
+    it += 4;
+    return true;
+}
+
+} // End of anonymous namespace
+
+string LongPollValue::str() const
+{
+    assert(type == STRING);
+    if (!escaped)
+        return string(begin, end);
+
+    string ret;
+    ret.reserve(end - begin);
+    for (const char* it = begin; it != end; ) {
+        if (*it != '\\') {
+            ret += *it++;
+            continue;
+        }
+        it++;
+        if (it == end)
+            break;
+        char c = *it++;
+        switch (c) {
+        case 'b':
+            ret += '\b';
+            break;
+        case 'f':
+            ret += '\f';
+            break;
+        case 'n':
+            ret += '\n';
+            break;
+        case 'r':
+            ret += '\r';
+            break;
+        case 't':
+            ret += '\t';
+            break;
+        case 'u': {
+            unsigned code;
+            if (!read_hex4(it, end, code)) {
+                append_utf8(ret, REPLACEMENT_CHARACTER);
+                break;
+            }
+            // Surrogate pair.
+            if (code >= 0xD800 && code < 0xDC00 && end - it >= 6 && it[0] == '\\' && it[1] == 'u') {
+                const char* low_it = it + 2;
+                unsigned low;
+                if (read_hex4(low_it, end, low) && low >= 0xDC00 && low < 0xE000) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    it = low_it;
+                }
+            }
+            // Surrogates without a pair cannot be encoded in UTF-8.
+            if (code >= 0xD800 && code < 0xE000)
+                code = REPLACEMENT_CHARACTER;
+            append_utf8(ret, code);
+            break;
+        }
+        default:
+            // \" \\ \/
+            ret += c;
+            break;
+        }
+    }
+    return ret;
+}
+
+picojson::value LongPollValue::parse() const
+{
+    picojson::value v;
+    const char* it = begin;
+    string err = picojson::parse(v, it, end);
+    if (!err.empty())
+        return picojson::value();
+    return v;
+}
+
+string LongPollValue::raw() const
+{
+    return string(begin, end);
+}
+
+string decode_long_poll_response(const char* begin, const char* end, LongPollResponse& response)
+{
+    response.failed = false;
+    response.failed_code = 0;
+    response.has_ts = false;
+    response.ts = 0;
+    response.updates.clear();
+
+    Scanner scanner(begin, end);
+    if (!scanner.consume('{'))
+        return "response is not an object";
+    if (scanner.consume('}'))
+        return "";
+
+    do {
+        LongPollValue key;
+        if (!scanner.read_value(key) || !key.is_string())
+            return "expected key";
+        if (!scanner.consume(':'))
+            return "expected colon";
+
+        string key_str(key.begin, key.end);
+        if (key_str == "updates") {
+            if (!scanner.consume('['))
+                return "updates is not an array";
+            if (!scanner.consume(']')) {
+                do {
+                    response.updates.emplace_back();
+                    if (!read_update(scanner, response.updates.back()))
+                        return "malformed update";
+                } while (scanner.consume(','));
+                if (!scanner.consume(']'))
+                    return "malformed updates";
+            }
+        } else {
+            LongPollValue value;
+            if (!scanner.read_value(value))
+                return "malformed value";
+            if (key_str == "ts" && value.is_number()) {
+                response.has_ts = true;
+                response.ts = value.number;
+            } else if (key_str == "ts" && value.is_string()) {
+                response.has_ts = true;
+                response.ts = atoll(value.str().data());
+            } else if (key_str == "failed" && value.is_number()) {
+                response.failed = true;
+                response.failed_code = value.number;
+            }
+        }
+    } while (scanner.consume(','));
+
+    if (!scanner.consume('}'))
+        return "expected end of object";
+    return "";
+}
@@ -0,0 +1,114 @@
+// Decoder for Long Poll responses.
+
+#pragma once
+
+#include "common.h"
+
+#include <contrib/picojson/picojson.h>
+
+// Long Poll responses are arrays of small fixed-layout arrays, e.g.
+//   {"ts":1820350874,"updates":[[4,2086944,17,123456,1455130080," ... ","Hello",{}],[8,-123456,7]]}
+// Parsing them into picojson DOM is wasteful: each update becomes an std::vector, each id
+// becomes a double and each string gets copied. This decoder parses the response once into
+// a flat list of updates, where each field is either an integer or a view into the response
+// buffer. Strings are unescaped and objects (attachments) are parsed only on demand.
+//
+// NOTE: All the views point into the original response buffer, so LongPollResponse must not
+// outlive the buffer it has been decoded from.
+
+// One field of Long Poll update.
+struct LongPollValue
+{
+    enum Type {
+        NUMBER,
+        STRING,
+        OBJECT,
+        ARRAY,
+        // true, false or null.
+        LITERAL
+    };
+
+    Type type;
+    // Value of NUMBER, fractional part is dropped.
+    int64 number;
+    // Raw JSON text of the value. For STRING, the quotes are not included.
+    const char* begin;
+    const char* end;
+    // Only for STRING: true if the string contains escape sequences.
+    bool escaped;
+
+    bool is_number() const
+    {
+        return type == NUMBER;
+    }
+
+    bool is_string() const
+    {
+        return type == STRING;
+    }
+
+    bool is_object() const
+    {
+        return type == OBJECT;
+    }
+
+    // Returns unescaped UTF-8 string. Must be called only for STRING.
+    string str() const;
+    // Parses the raw text into picojson value. Returns null value if parsing fails.
+    picojson::value parse() const;
+    // Returns the raw JSON text of the value, used for logging.
+    string raw() const;
+};
+
+// Maximum number of fields we care about in one update. The extra fields are silently dropped.
+const size_t LONG_POLL_MAX_FIELDS = 10;
+
+// One update: an array of fields, the first one being the update code.
+struct LongPollUpdate
+{
+    LongPollValue fields[LONG_POLL_MAX_FIELDS];
+    size_t size;
+    // Raw JSON text of the whole update, used for logging.
+    const char* begin;
+    const char* end;
+
+    bool contains(size_t i) const
+    {
+        return i < size;
+    }
+
+    const LongPollValue& get(size_t i) const
+    {
+        assert(i < size);
+        return fields[i];
+    }
+
+    // Returns true if field i is present and is a number.
+    bool has_number(size_t i) const
+    {
+        return contains(i) && fields[i].is_number();
+    }
+
+    string raw() const
+    {
+        return string(begin, end);
+    }
+};
+
+// The whole Long Poll response.
+struct LongPollResponse
+{
+    // Set if response contains "failed" key. ts is updated only for failed == 1 (the history
+    // is outdated, but ts is returned).
+    bool failed;
+    int failed_code;
+
+    bool has_ts;
+    uint64 ts;
+
+    vector<LongPollUpdate> updates;
+};
+
+// Decodes Long Poll response from [begin, end). Returns empty string on success or an error
+// message. Unknown keys are skipped, malformed updates (not arrays) are reported as errors.
+string decode_long_poll_response(const char* begin, const char* end, LongPollResponse& response);
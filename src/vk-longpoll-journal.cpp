@@ -0,0 +1,114 @@
+#include <cerrno>
+#include <cstring>
+#include <glib/gstdio.h>
+#include <util.h>
+
+#include "vk-longpoll-journal.h"
+
+namespace
+{
+
+// The journal is rotated after reaching this size.
+const size_t MAX_JOURNAL_SIZE = 16 * 1024 * 1024;
+
+} // End of anonymous namespace
+
+LongPollJournal::LongPollJournal(const string& path)
+    : m_path(path),
+      m_size(0)
+{
+    open();
+}
+
+void LongPollJournal::append(const char* response, size_t len)
+{
+    if (!m_file.is_open())
+        return;
+
+    int64 timestamp = g_get_real_time() / 1000;
+    string header = str_format("%lld %zu\n", (long long)timestamp, len);
+    m_file.write(header.data(), header.size());
+    m_file.write(response, len);
+    m_file.put('\n');
+    m_file.flush();
+    if (m_file.fail()) {
+        vkcom_debug_error("Error writing to Long Poll journal %s: %s\n", m_path.data(), strerror(errno));
+        m_file.close();
+        return;
+    }
+
+    m_size += header.size() + len + 1;
+    if (m_size >= MAX_JOURNAL_SIZE)
+        rotate();
+}
+
+void LongPollJournal::open()
+{
+    m_file.open(m_path.data(), std::ios::binary | std::ios::app);
+    if (!m_file.is_open()) {
+        vkcom_debug_error("Error opening Long Poll journal %s: %s\n", m_path.data(), strerror(errno));
+        return;
+    }
+    // tellp is zero for a newly opened file in append mode, so we seek to the end.
+    m_file.seekp(0, std::ios::end);
+    m_size = m_file.tellp();
+    vkcom_debug_info("Writing Long Poll journal to %s\n", m_path.data());
+}
+
+void LongPollJournal::rotate()
+{
+    m_file.close();
+
+    string old_path = m_path + ".1";
+    // g_rename does not replace existing files on Windows.
+    g_remove(old_path.data());
+    if (g_rename(m_path.data(), old_path.data()) != 0)
+        vkcom_debug_error("Error rotating Long Poll journal %s: %s\n", m_path.data(), strerror(errno));
+
+    open();
+}
+
+bool read_long_poll_journal(const string& path, vector<LongPollJournalRecord>& records)
+{
+    std::ifstream file(path.data(), std::ios::binary);
+    if (!file.is_open()) {
+        vkcom_debug_error("Error opening Long Poll journal %s: %s\n", path.data(), strerror(errno));
+        return false;
+    }
+
+    string header;
+    while (std::getline(file, header)) {
+        long long timestamp;
+        unsigned long len;
+        if (sscanf(header.data(), "%lld %lu", &timestamp, &len) != 2) {
+            vkcom_debug_error("Malformed record header in Long Poll journal: %s\n", header.data());
+            return false;
+        }
+
+        LongPollJournalRecord record;
+        record.timestamp = timestamp;
+        record.response.resize(len);
+        file.read(&record.response[0], len);
+        if (file.fail() || file.get() != '\n') {
+            vkcom_debug_error("Truncated record in Long Poll journal %s\n", path.data());
+            return false;
+        }
+        records.push_back(std::move(record));
+    }
+    return true;
+}
+
+string get_long_poll_journal_path(PurpleConnection* gc)
+{
+    PurpleAccount* account = purple_connection_get_account(gc);
+    string filename = str_format("%s-longpoll.journal",
+                                 purple_escape_filename(purple_account_get_username(account)));
+
+    char* dir = g_build_filename(purple_user_dir(), "vkcom", nullptr);
+    g_mkdir_with_parents(dir, 0700);
+    char* path = g_build_filename(dir, filename.data(), nullptr);
+    string ret = path;
+    g_free(path);
+    g_free(dir);
+    return ret;
+}
@@ -0,0 +1,47 @@
+// Journal of raw Long Poll responses, used for debugging and benchmarking event processing.
+
+#pragma once
+
+#include <fstream>
+
+#include "common.h"
+
+#include <connection.h>
+
+// Journal is a sequence of records, each record being
+//   <timestamp in msec> <length>\n<raw response>\n
+// When the journal grows over the size limit, it is renamed to <path>.1 (replacing the older one)
+// and a new journal is started.
+class LongPollJournal
+{
+public:
+    // Opens journal at path for appending.
+    LongPollJournal(const string& path);
+
+    DISABLE_COPYING(LongPollJournal)
+
+    // Appends response, received right now, to the journal.
+    void append(const char* response, size_t len);
+
+private:
+    string m_path;
+    std::ofstream m_file;
+    size_t m_size;
+
+    void open();
+    void rotate();
+};
+
+// One record in journal.
+struct LongPollJournalRecord
+{
+    int64 timestamp;
+    string response;
+};
+
+// Reads all records from journal. Returns false if the journal cannot be opened or is malformed,
+// records contains all the records read before error.
+bool read_long_poll_journal(const string& path, vector<LongPollJournalRecord>& records);
+
+// Returns default journal path for the account (inside purple user dir).
+string get_long_poll_journal_path(PurpleConnection* gc);
@@ -1,15 +1,24 @@
 #include "common.h"
 
+#include <algorithm>
 #include <ctime>
+#include <gio/gio.h>
 #include <server.h>
 
 #include "httputils.h"
 #include "miscutils.h"
 #include "vk-api.h"
+#include "vk-backfill.h"
 #include "vk-buddy.h"
 #include "vk-chat.h"
 #include "vk-common.h"
+#include "vk-log-writer.h"
+#include "vk-longpoll-decoder.h"
+#include "vk-longpoll-journal.h"
 #include "vk-message-recv.h"
+#include "vk-message-sequencer.h"
+#include "vk-message-store.h"
+#include "vk-replay-sink.h"
 #include "vk-smileys.h"
 #include "vk-utils.h"
 
@@ -35,6 +44,18 @@ void save_last_msg_id(PurpleConnection* gc, uint64 last_msg_id);
 
 // Helper for start_long_poll.
 void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id);
+// Calls receive_messages_range unless it is running already, in which case received_cb is called
+// when the running one finishes.
+void sync_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb);
+
+// NOTE: Re watchdog: silently dropped TCP connections (NAT timeouts, switching Wi-Fi networks) are
+// detected by the watchdog, which expects a response within LONG_POLL_WAIT + LONG_POLL_MARGIN
+// seconds, and by GNetworkMonitor notifications. In both cases the current request is abandoned
+// and we reconnect via start_long_poll_impl, which receives all messages since last_msg_id, instead
+// of disconnecting the whole account.
+
+// Starts the watchdog timer and subscribes to network connectivity changes.
+void start_long_poll_watchdog(PurpleConnection* gc);
 
 } // End of anonymous namespace
 
@@ -42,9 +63,28 @@ void start_long_poll(PurpleConnection* gc)
 {
     uint64 last_msg_id = load_last_msg_id(gc);
     vkcom_debug_info("Starting Long Poll with last msg id %llu\n", (unsigned long long)last_msg_id);
+    VkData& gc_data = get_data(gc);
+    if (gc_data.options().long_poll_journal)
+        gc_data.long_poll.journal.reset(new LongPollJournal(get_long_poll_journal_path(gc)));
+    start_long_poll_watchdog(gc);
     start_long_poll_impl(gc, last_msg_id);
 }
 
+void stop_long_poll(PurpleConnection* gc)
+{
+    VkLongPollState& state = get_data(gc).long_poll;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    if (state.network_changed_handler != 0) {
+        g_signal_handler_disconnect(g_network_monitor_get_default(), state.network_changed_handler);
+        state.network_changed_handler = 0;
+    }
+#endif
+
+    if (state.reconnect_count > 0)
+        vkcom_debug_info("Long Poll reconnected %u times, total downtime %d sec\n", state.reconnect_count,
+                         (int)to_seconds(state.total_downtime));
+}
+
 namespace
 {
 
@@ -80,11 +120,33 @@ void request_long_poll(PurpleConnection* gc, const string& server, const string&
                        LastMsg last_msg);
 // Disconnects account on Long Poll errors as we do not have anything to do after that really.
 void long_poll_fatal(PurpleConnection* gc);
+// Abandons the current Long Poll request and reconnects. Disconnects the account after
+// MAX_LONG_POLL_RECONNECTS consecutive failures.
+void long_poll_reconnect(PurpleConnection* gc, const char* reason);
+// Calls long_poll_reconnect if we are reconnecting already, long_poll_fatal otherwise (we could not
+// connect to Long Poll upon login).
+void long_poll_error(PurpleConnection* gc, const char* reason);
+// Updates reconnection metrics after the connection has been restored.
+void long_poll_restored(PurpleConnection* gc);
+
+// Long Poll server holds the request for up to LONG_POLL_WAIT seconds, so if no response arrives
+// in LONG_POLL_WAIT + LONG_POLL_MARGIN seconds, the connection is considered dead.
+const int LONG_POLL_WAIT = 25;
+const int LONG_POLL_MARGIN = 5;
+// The first reconnect is immediate, next ones are exponentially delayed up to the maximum.
+const unsigned MAX_LONG_POLL_RECONNECTS = 6;
+const unsigned MAX_LONG_POLL_RECONNECT_DELAY = 60000;
 
 void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
 {
+    // If we reconnect while this function waits for responses, this chain of calls must stop.
+    unsigned generation = get_data(gc).long_poll.generation;
+
     CallParams params = { {"use_ssl", "1"} };
     vk_call_api(gc, "messages.getLongPollServer", params, [=](const picojson::value& v) {
+        if (get_data(gc).long_poll.generation != generation)
+            return;
+
         // The connection status can be not connected, because we could've skipped the whole authentication part
         // in vk-auth.cpp if the access token is stored. Here is the first place where we can guarantee, that
         // the connection really succeeded.
@@ -95,7 +157,7 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
                 || !field_is_present<string>(v, "server") || !field_is_present<double>(v, "ts")) {
             vkcom_debug_error("Strange response from messages.getLongPollServer: %s\n",
                                v.serialize().data());
-            long_poll_fatal(gc);
+            long_poll_error(gc, "strange response from messages.getLongPollServer");
             return;
         }
 
@@ -105,7 +167,10 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
         update_friends_presence(gc, [=] {
             // Start updaing user and chat infos, buddy list.
             update_user_chat_infos(gc);
-            receive_messages_range(gc, last_msg_id,  [=](uint64 max_msg_id) {
+            sync_messages_range(gc, last_msg_id, [=](uint64 max_msg_id) {
+                if (get_data(gc).long_poll.generation != generation)
+                    return;
+
                 // We've received no new messages.
                 if (max_msg_id == 0)
                     max_msg_id = last_msg_id;
@@ -116,10 +181,13 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
                         || !field_is_present<double>(v, "ts")) {
                     vkcom_debug_error("Wrong response from messages.getLongPollServer: %s\n",
                                        v.serialize().data());
-                    long_poll_fatal(gc);
+                    long_poll_error(gc, "strange response from messages.getLongPollServer");
                     return;
                 }
 
+                long_poll_restored(gc);
+                start_history_backfill(gc);
+
                 const string& server = v.get("server").get<string>();
                 const string& key = v.get("key").get<string>();
                 double ts = v.get("ts").get<double>();
@@ -127,72 +195,108 @@ void start_long_poll_impl(PurpleConnection* gc, uint64 last_msg_id)
             });
         });
     }, [=](const picojson::value&) {
-        long_poll_fatal(gc);
+        if (get_data(gc).long_poll.generation != generation)
+            return;
+        long_poll_error(gc, "messages.getLongPollServer failed");
+    });
+}
+
+void sync_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb)
+{
+    VkLongPollState& state = get_data(gc).long_poll;
+    state.range_sync_cbs.push_back(received_cb);
+    if (state.range_sync_cbs.size() > 1) {
+        vkcom_debug_info("Messages are being received already, waiting for them\n");
+        return;
+    }
+
+    receive_messages_range(gc, last_msg_id, [=](uint64 max_msg_id) {
+        vector<ReceivedCb> callbacks;
+        callbacks.swap(get_data(gc).long_poll.range_sync_cbs);
+        for (const ReceivedCb& cb: callbacks)
+            cb(max_msg_id);
     });
 }
 
 // Reads and processes an event from updates array.
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
+void process_update(PurpleConnection* gc, const LongPollUpdate& v, LastMsg& last_msg);
 
-// We request platform to detect desktop/mobile status and attachments to get "from"
-// in chats.
-const char* long_poll_url = "https://%s?act=a_check&key=%s&ts=%llu&wait=25&mode=66";
+// We request platform to detect desktop/mobile status, attachments to get "from"
+// in chats and random_id to match outgoing messages with messages.send calls. Version 3 adds
+// full attachment objects to the attachments field, older servers simply omit them and we fall
+// back to messages.getById.
+const char* long_poll_url = "https://%s?act=a_check&key=%s&ts=%llu&wait=%d&mode=194&version=3";
 
 void request_long_poll(PurpleConnection* gc, const string& server, const string& key, uint64 ts,
                        LastMsg last_msg)
 {
-    string server_url = str_format(long_poll_url, server.data(), key.data(), ts);
+    string server_url = str_format(long_poll_url, server.data(), key.data(), ts, LONG_POLL_WAIT);
 #if 0
     vkcom_debug_info("Connecting to Long Poll %s\n", server_url.data());
 #endif
 
-    http_get(gc, server_url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
+    VkLongPollState& state = get_data(gc).long_poll;
+    unsigned generation = state.generation;
+    state.request_running = true;
+    state.request_time = steady_clock::now();
+    // The watchdog should detect dead connections earlier, HTTP timeout is just a safety net.
+    int timeout = LONG_POLL_WAIT + 2 * LONG_POLL_MARGIN;
+    state.http_conn = http_get_no_retry(gc, server_url, timeout, [=](PurpleHttpConnection*,
+                                                                     PurpleHttpResponse* response) {
         // Connection has been cancelled due to account being disconnected.
         if (get_data(gc).is_closing())
             return;
 
+        // The request has been abandoned by the watchdog.
+        VkLongPollState& cur_state = get_data(gc).long_poll;
+        if (cur_state.generation != generation)
+            return;
+        cur_state.request_running = false;
+        cur_state.http_conn = nullptr;
+
         if (purple_http_response_get_code(response) != 200) {
             vkcom_debug_error("Error while reading response from Long Poll server: %s\n",
                                purple_http_response_get_error(response));
-            long_poll_fatal(gc);
+            long_poll_reconnect(gc, "error while reading response");
             return;
         }
 
-        const char* response_text = purple_http_response_get_data(response, nullptr);
-        const char* response_text_copy = response_text; // Picojson updates iterators it received.
-        picojson::value root;
-        string error = picojson::parse(root, response_text, response_text + strlen(response_text));
+        size_t response_len;
+        const char* response_text = purple_http_response_get_data(response, &response_len);
+        if (cur_state.journal)
+            cur_state.journal->append(response_text, response_len);
+
+        LongPollResponse root;
+        string error = decode_long_poll_response(response_text, response_text + response_len, root);
         if (!error.empty()) {
-            vkcom_debug_error("Error parsing %s: %s\n", response_text_copy, error.data());
-            long_poll_fatal(gc);
+            vkcom_debug_error("Error parsing %s: %s\n", response_text, error.data());
+            long_poll_reconnect(gc, "error parsing response");
             return;
         }
-        if (!root.is<picojson::object>()) {
-            vkcom_debug_error("Strange response from Long Poll: %s\n", response_text_copy);
-            long_poll_fatal(gc);
+
+        // A response without ts counts as a failed reconnect, so that a server, which keeps sending
+        // them, eventually disconnects the account.
+        if (!root.failed && !root.has_ts) {
+            vkcom_debug_error("Strange response from Long Poll: %s\n", response_text);
+            long_poll_reconnect(gc, "no ts in response");
             return;
         }
 
-        if (root.contains("failed")) {
+        // We have got a proper response, so the connection works fine.
+        cur_state.failed_reconnects = 0;
+
+        if (root.failed) {
             vkcom_debug_info("Long Poll got tired, re-requesting Long Poll server address\n");
             start_long_poll_impl(gc, last_msg.id);
             return;
         }
 
-        if (!field_is_present<double>(root, "ts") || !field_is_present<picojson::array>(root, "updates")) {
-            vkcom_debug_error("Strange response from Long Poll: %s\n", response_text_copy);
-            long_poll_fatal(gc);
-            return;
-        }
-
         LastMsg next_last_msg = last_msg;
 
-        const picojson::array& updates = root.get("updates").get<picojson::array>();
-        for (const picojson::value& v: updates)
+        for (const LongPollUpdate& v: root.updates)
             process_update(gc, v, next_last_msg);
 
-        uint64 next_ts = root.get("ts").get<double>();
-        request_long_poll(gc, server, key, next_ts, next_last_msg);
+        request_long_poll(gc, server, key, root.ts, next_last_msg);
     });
 }
 
@@ -227,25 +331,34 @@ enum MessageFlags
     MESSAGE_FLAG_MEDIA = 512
 };
 
-// Processes message event.
-void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg);
+// Processes message event. Chat messages are sent with chat_id + CHAT_ID_OFFSET as user id and
+// the author in "from" extra field, the ones without it are received via messages.getById.
+void process_message(PurpleConnection* gc, const LongPollUpdate& v, LastMsg& last_msg);
+// Processes message deletion and the changes of message flags: messages, which have been read
+// or deleted, are dropped from the ones we are going to mark as read.
+void process_flags(PurpleConnection* gc, const LongPollUpdate& v, int code);
 // Processes user online/offline event.
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online);
+void process_online(PurpleConnection* gc, const LongPollUpdate& v, bool online);
 // Processes update of chat parameters.
-void process_chat_update(PurpleConnection* gc, const picojson::value& v);
+void process_chat_update(PurpleConnection* gc, const LongPollUpdate& v);
 // Processes user typing event.
-void process_typing(PurpleConnection* gc, const picojson::value& v);
+void process_typing(PurpleConnection* gc, const LongPollUpdate& v);
 
-void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg)
+void process_update(PurpleConnection* gc, const LongPollUpdate& v, LastMsg& last_msg)
 {
-    if (!v.is<picojson::array>() || !v.contains(0)) {
-        vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                           v.serialize().data());
+    if (!v.has_number(0)) {
+        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
         return;
     }
 
-    int code = v.get(0).get<double>();
+    int code = v.get(0).number;
     switch (code) {
+    case LONG_POLL_MESSAGE_DELETED:
+    case LONG_POLL_FLAGS_RESET:
+    case LONG_POLL_FLAGS_SET:
+    case LONG_POLL_FLAGS_CLEAR:
+        process_flags(gc, v, code);
+        break;
     case LONG_POLL_MESSAGE:
         process_message(gc, v, last_msg);
         break;
@@ -269,20 +382,32 @@ void process_update(PurpleConnection* gc, const picojson::value& v, LastMsg& las
 // Process incoming and outgoing messages respectively. In general, there is duplication between these functions
 // and vk-message-recv code, they should somehow be refactored.
 void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, string text,
-                                       uint64 timestamp, const picojson::value *attachments);
+                                       uint64 timestamp, const picojson::value& extra);
 void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, string text,
-                                       uint64 timestamp);
-
-void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& last_msg)
+                                       uint64 timestamp, const picojson::value& extra);
+// Write plain-text incoming message to the conversation. who is the buddy name, from is the author
+// display name. They are called directly if the peer is known and in the buddy list (or the chat
+// conversation is open), which is the common case, and after adding the peer otherwise.
+void got_incoming_im(PurpleConnection* gc, uint64 msg_id, uint64 user_id, const string& who,
+                     const string& from, const string& text, uint64 timestamp);
+void got_incoming_chat_message(PurpleConnection* gc, uint64 msg_id, uint64 chat_id, int conv_id,
+                               uint64 from_user_id, const string& text, uint64 timestamp);
+// Tries to process message with attachments straight from the Long Poll event. Returns false
+// if the message must be received via messages.getById.
+bool process_media_message(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, const string& text,
+                           uint64 timestamp, const picojson::value& extra);
+
+void process_message(PurpleConnection* gc, const LongPollUpdate& v, LastMsg& last_msg)
 {
-    if (!v.contains(6) || !v.get(1).is<double>() || !v.get(2).is<double>() || !v.get(3).is<double>()
-            || !v.get(4).is<double>() || !v.get(6).is<string>()) {
-        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.serialize().data());
-        purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                                       i18n("Unable to receive message"));
+    if (!v.has_number(1) || !v.has_number(2) || !v.has_number(3) || !v.has_number(4)
+            || !v.contains(6) || !v.get(6).is_string()) {
+        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
+        if (!dropped_in_replay(gc, "purple_connection_error_reason"))
+            purple_connection_error_reason(gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                                           i18n("Unable to receive message"));
         return;
     }
-    uint64 msg_id = v.get(1).get<double>();
+    uint64 msg_id = v.get(1).number;
     // Check if we already processed this message in receive_messages_range.
     if (msg_id <= last_msg.ignored)
         return;
@@ -294,10 +419,10 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
         save_last_msg_id(gc, msg_id);
     }
 
-    int flags = v.get(2).get<double>();
+    int flags = v.get(2).number;
 
-    uint64 user_id = v.get(3).get<double>();
-    uint64 timestamp = v.get(4).get<double>();
+    uint64 user_id = v.get(3).number;
+    uint64 timestamp = v.get(4).number;
     // NOTE:
     // * The text is simple UTF-8 text with some HTML leftovers:
     //   * The only tag which it may contain is <br> (API v5.0 stopped using <br>, but Long Poll
@@ -305,65 +430,74 @@ void process_message(PurpleConnection* gc, const picojson::value& v, LastMsg& la
     //   * &amp; &lt; &gt; &quot; are escaped.
     // * Links are sent as plaintext, both Vk.com and Pidgin linkify messages automatically.
     // * Smileys are returned as Unicode emoji.
-    string text = v.get(6).get<string>();
+    string text = v.get(6).str();
 
-    const picojson::value* attachments = nullptr;
-    if (v.contains(7))
-        attachments = &v.get(7);
+    // Extra fields (attachments, "from" for chat messages) are parsed only when they are really
+    // needed: for chat messages and messages with media.
+    picojson::value extra;
+    if (v.contains(7) && v.get(7).is_object()
+            && ((flags & MESSAGE_FLAG_MEDIA) || user_id >= CHAT_ID_OFFSET))
+        extra = v.get(7).parse();
 
     if (!(flags & MESSAGE_FLAGS_OUTBOX)) {
         // Processing incoming message
         vkcom_debug_info("Got incoming message from %llu\n", (unsigned long long)user_id);
 
         process_incoming_message_internal(gc, msg_id, flags, user_id, std::move(text), timestamp,
-                                          attachments);
+                                          extra);
     } else {
         // Process outgoing message. This message could've been sent either by us, or by another
         // connected client. See description in vk-common.h of corresponding members of VkData
         // for details.
         vkcom_debug_info("Got outgoing message\n");
 
-        VkData& gc_data = get_data(gc);
-        // The message has been sent by us, ignore it.
-        if (gc_data.remove_sent_msg_id(msg_id))
-            return;
-
-        steady_duration since_last_msg_sent = steady_clock::now() - gc_data.last_msg_sent_time();
-        if (to_milliseconds(since_last_msg_sent) >= 30000) {
-            // This is fast path: the message is guaranteed to be sent from someplace else,
-            // no need for timeout.
-            process_outgoing_message_internal(gc, msg_id, flags, user_id, std::move(text),
-                                              timestamp);
-            return;
-        }
+        // random_id is present only if the message has been sent with it.
+        uint64 random_id = 0;
+        if (v.has_number(8))
+            random_id = v.get(8).number;
 
-        // The last message, which has been sent by us, has been sent not long ago (i.e. less
-        // than 1 second).
-        vkcom_debug_info("We sent message not long ago, let's have a check after timeout\n");
-        timeout_add(gc, 30000, [=] {
-            // Check again after 30 seconds, whether we sent the message or not.
-            if (get_data(gc).remove_sent_msg_id(msg_id))
-                return false;
-
-            vkcom_debug_error("We have sent a message not long ago, but not all"
-                              " msg id are belong to us (msg id %llu)\n",
-                              (unsigned long long)msg_id);
-            process_outgoing_message_internal(gc, msg_id, flags, user_id, std::move(text),
-                                              timestamp);
-            return false;
+        get_data(gc).process_outgoing_echo(msg_id, random_id, [=] {
+            process_outgoing_message_internal(gc, msg_id, flags, user_id, text, timestamp, extra);
         });
     }
 }
 
-// NOTE: Chat messages are sent with chat_id + CHAT_ID_OFFSET as user id, unfortunately, no user id
-// is stored, so we have to call messages.get.
-const uint64 CHAT_ID_OFFSET = 2000000000LL;
+void process_flags(PurpleConnection* gc, const LongPollUpdate& v, int code)
+{
+    if (!v.has_number(1) || (code != LONG_POLL_MESSAGE_DELETED && !v.has_number(2))) {
+        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
+        return;
+    }
+    uint64 msg_id = v.get(1).number;
+    int flags = code != LONG_POLL_MESSAGE_DELETED ? v.get(2).number : 0;
+    // Peer id is sent only by newer Long Poll versions.
+    uint64 peer_id = v.has_number(3) ? v.get(3).number : 0;
+
+    bool read_or_deleted;
+    switch (code) {
+    case LONG_POLL_MESSAGE_DELETED:
+        read_or_deleted = true;
+        break;
+    case LONG_POLL_FLAGS_RESET:
+        read_or_deleted = !(flags & MESSAGE_FLAG_UNREAD) || (flags & MESSAGE_FLAG_DELETED);
+        break;
+    case LONG_POLL_FLAGS_SET:
+        // Messages, marked as unread on other clients, are left for the user to read there.
+        read_or_deleted = flags & MESSAGE_FLAG_DELETED;
+        break;
+    default:
+        read_or_deleted = flags & MESSAGE_FLAG_UNREAD;
+        break;
+    }
+    if (read_or_deleted)
+        message_read_elsewhere(gc, peer_id, msg_id);
+}
 
 const uint64 PLATFORM_WEB = 7;
 
 void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int flags,
                                        uint64 user_id, string text, uint64 timestamp,
-                                       const picojson::value* attachments)
+                                       const picojson::value& extra)
 {
     // NOTE:
     //  There are two ways of processing messages with attachments:
@@ -376,103 +510,193 @@ void process_incoming_message_internal(PurpleConnection* gc, uint64 msg_id, int
     //   * there is no video.getById so we can show no information on video;
     //   * it takes at least one additional call per message (receive_messages takes exactly one
     //     call).
+    //  Newer Long Poll versions send full attachment objects, which are rendered directly
+    //  in process_media_message if possible.
     if (flags & MESSAGE_FLAG_MEDIA) {
-        receive_messages(gc, { msg_id });
+        // The message is written in finish_receiving, the following ones must wait for it.
+        get_message_sequencer(gc).hold(user_id, msg_id);
+        if (!process_media_message(gc, msg_id, flags, user_id, text, timestamp, extra))
+            receive_messages(gc, { msg_id });
     } else {
         convert_incoming_smileys(text);
 
         if (user_id < CHAT_ID_OFFSET) {
+            // The buddy is looked up once and used both for the check and for the display name.
+            string who = user_name_from_id(user_id);
+            PurpleBuddy* buddy = purple_find_buddy(purple_connection_get_account(gc), who.data());
+            if (buddy && !is_unknown_user(gc, user_id)) {
+                got_incoming_im(gc, msg_id, user_id, who, purple_buddy_get_alias(buddy), text, timestamp);
+                return;
+            }
+
+            get_message_sequencer(gc).hold(user_id, msg_id);
             add_buddy_if_needed(gc, user_id, [=] {
-                serv_got_im(gc, user_name_from_id(user_id).data(), text.data(), PURPLE_MESSAGE_RECV,
-                            timestamp);
-                mark_message_as_read(gc, { VkReceivedMessage{ msg_id, user_id, 0 } });
+                got_incoming_im(gc, msg_id, user_id, who, get_user_display_name(gc, user_id), text,
+                                timestamp);
             });
         } else {
             uint64 chat_id = user_id - CHAT_ID_OFFSET;
 
-            if (!attachments || !attachments->contains("from")
-                    || !attachments->get("from").is<string>()) {
-                vkcom_debug_error("Chat message has wrong attachments: %s\n", attachments
-                                  ? attachments->serialize().data() : "null");
-                // Let's try to receive the message the other way.
+            if (!field_is_present<string>(extra, "from")) {
+                vkcom_debug_error("Chat message has wrong attachments: %s\n", extra.serialize().data());
+                // Let's try to receive the message the other way. The following messages must
+                // wait for it.
+                get_message_sequencer(gc).hold(user_id, msg_id);
                 receive_messages(gc, { msg_id });
                 return;
             }
 
-            const string& from_user_id_str = attachments->get("from").get<string>();
+            const string& from_user_id_str = extra.get("from").get<string>();
             uint64 from_user_id = atoll(from_user_id_str.data());
             if (from_user_id == 0) {
-                vkcom_debug_error("Chat message has wrong attachments: %s\n", attachments
-                                  ? attachments->serialize().data() : "null");
-                // Let's try to receive the message the other way.
+                vkcom_debug_error("Chat message has wrong attachments: %s\n", extra.serialize().data());
+                // Let's try to receive the message the other way. The following messages must
+                // wait for it.
+                get_message_sequencer(gc).hold(user_id, msg_id);
                 receive_messages(gc, { msg_id });
                 return;
             }
 
+            int conv_id = chat_id_to_conv_id(gc, chat_id);
+            if (conv_id != 0) {
+                got_incoming_chat_message(gc, msg_id, chat_id, conv_id, from_user_id, text, timestamp);
+                return;
+            }
+
             // TODO: Remove code duplication with vk-message-recv.cpp
+            get_message_sequencer(gc).hold(user_id, msg_id);
             open_chat_conv(gc, chat_id, [=] {
-                int conv_id = chat_id_to_conv_id(gc, chat_id);
-                string from = get_user_display_name(gc, from_user_id, chat_id);
-                serv_got_chat_in(gc, conv_id, from.data(), PURPLE_MESSAGE_RECV, text.data(),
-                                 timestamp);
-                mark_message_as_read(gc, { VkReceivedMessage{ msg_id, from_user_id, chat_id } });
+                got_incoming_chat_message(gc, msg_id, chat_id, chat_id_to_conv_id(gc, chat_id),
+                                          from_user_id, text, timestamp);
             });
         }
     }
 }
 
+void got_incoming_im(PurpleConnection* gc, uint64 msg_id, uint64 user_id, const string& who,
+                     const string& from, const string& text, uint64 timestamp)
+{
+    get_message_sequencer(gc).deliver(user_id, msg_id, [=] {
+        if (!dropped_in_replay(gc, "serv_got_im"))
+            serv_got_im(gc, who.data(), text.data(), PURPLE_MESSAGE_RECV, timestamp);
+        get_message_store(gc).append({ msg_id, user_id, false, (time_t)timestamp, from, text });
+        mark_message_as_read(gc, { VkReceivedMessage{ msg_id, user_id, 0 } });
+    });
+}
+
+void got_incoming_chat_message(PurpleConnection* gc, uint64 msg_id, uint64 chat_id, int conv_id,
+                               uint64 from_user_id, const string& text, uint64 timestamp)
+{
+    get_message_sequencer(gc).deliver(peer_id_from_ids(0, chat_id), msg_id, [=] {
+        string from = get_user_display_name(gc, from_user_id, chat_id);
+        if (!dropped_in_replay(gc, "serv_got_chat_in"))
+            serv_got_chat_in(gc, conv_id, from.data(), PURPLE_MESSAGE_RECV, text.data(), timestamp);
+        get_message_store(gc).append({ msg_id, peer_id_from_ids(0, chat_id), false, (time_t)timestamp,
+                                       from, text });
+        mark_message_as_read(gc, { VkReceivedMessage{ msg_id, from_user_id, chat_id } });
+    });
+}
+
 void process_outgoing_message_internal(PurpleConnection* gc, uint64 msg_id, int flags,
-                                       uint64 user_id, string text, uint64 timestamp)
+                                       uint64 user_id, string text, uint64 timestamp,
+                                       const picojson::value& extra)
 {
     // See NOTE in process_incoming_message_internal. Unlik incoming messages, we know perfectly
     // well who is the message author for outgoing messages.
     if (flags & MESSAGE_FLAG_MEDIA) {
-        receive_messages(gc, { msg_id });
+        // The message is written in finish_receiving, the following ones must wait for it.
+        get_message_sequencer(gc).hold(user_id, msg_id);
+        if (!process_media_message(gc, msg_id, flags, user_id, text, timestamp, extra))
+            receive_messages(gc, { msg_id });
     } else {
         convert_incoming_smileys(text);
 
-        // Check if the conversation is open, so that we write to the conversation, not the log.
-        // TODO: Remove code duplication with vk-message-recv.cpp
-        if (user_id < CHAT_ID_OFFSET) {
-            PurpleConversation* conv = find_conv_for_id(gc, user_id, 0);
-            string from = purple_account_get_name_for_display(purple_connection_get_account(gc));
-            if (conv) {
-                purple_conv_im_write(PURPLE_CONV_IM(conv), from.data(), text.data(),
-                                     PURPLE_MESSAGE_SEND, timestamp);
-            } else {
-                PurpleLogCache logs(gc);
-                PurpleLog* log = logs.for_user(user_id);
-                purple_log_write(log, PURPLE_MESSAGE_SEND, from.data(), timestamp, text.data());
-            }
-        } else {
-            uint64 chat_id = user_id - CHAT_ID_OFFSET;
-            PurpleConversation* conv = find_conv_for_id(gc, 0, chat_id);
-            string from = get_self_chat_display_name(gc);
-            if (conv) {
-                purple_conv_chat_write(PURPLE_CONV_CHAT(conv), from.data(), text.data(),
-                                       PURPLE_MESSAGE_SEND, timestamp);
+        get_message_sequencer(gc).deliver(user_id, msg_id, [=] {
+            // Check if the conversation is open, so that we write to the conversation, not the log.
+            // TODO: Remove code duplication with vk-message-recv.cpp
+            if (user_id < CHAT_ID_OFFSET) {
+                PurpleConversation* conv = find_conv_for_id(gc, user_id, 0);
+                string from = purple_account_get_name_for_display(purple_connection_get_account(gc));
+                if (conv) {
+                    if (!dropped_in_replay(gc, "purple_conv_im_write"))
+                        purple_conv_im_write(PURPLE_CONV_IM(conv), from.data(), text.data(),
+                                             PURPLE_MESSAGE_SEND, timestamp);
+                } else {
+                    get_log_writer(gc).write(user_id, 0, PURPLE_MESSAGE_SEND, from, timestamp, text);
+                }
+                get_message_store(gc).append({ msg_id, user_id, true, (time_t)timestamp, from, text });
             } else {
-                PurpleLogCache logs(gc);
-                PurpleLog* log = logs.for_chat(chat_id);
-                purple_log_write(log, PURPLE_MESSAGE_SEND, from.data(), timestamp, text.data());
+                uint64 chat_id = user_id - CHAT_ID_OFFSET;
+                PurpleConversation* conv = find_conv_for_id(gc, 0, chat_id);
+                string from = get_self_chat_display_name(gc);
+                if (conv) {
+                    if (!dropped_in_replay(gc, "purple_conv_chat_write"))
+                        purple_conv_chat_write(PURPLE_CONV_CHAT(conv), from.data(), text.data(),
+                                               PURPLE_MESSAGE_SEND, timestamp);
+                } else {
+                    get_log_writer(gc).write(0, chat_id, PURPLE_MESSAGE_SEND, from, timestamp, text);
+                }
+                get_message_store(gc).append({ msg_id, user_id, true, (time_t)timestamp, from, text });
             }
-        }
+        });
+    }
+}
+
+bool process_media_message(PurpleConnection* gc, uint64 msg_id, int flags, uint64 user_id, const string& text,
+                           uint64 timestamp, const picojson::value& extra)
+{
+    // Forwarded messages are sent only as ids, so we cannot render them here.
+    if (!field_is_present<string>(extra, "attachments") || extra.contains("fwd"))
+        return false;
+
+    const string& attachments_str = extra.get("attachments").get<string>();
+    picojson::value attachments;
+    const char* attachments_begin = attachments_str.data();
+    string err = picojson::parse(attachments, attachments_begin,
+                                 attachments_str.data() + attachments_str.size());
+    if (!err.empty() || !attachments.is<picojson::array>()) {
+        vkcom_debug_error("Unable to parse attachments from Long Poll: %s\n", attachments_str.data());
+        return false;
     }
+
+    // Build the message in the same format as messages.getById returns. Long Poll text
+    // is HTML-escaped, while message body is plain text.
+    picojson::object fields = {
+        {"id", picojson::value((double)msg_id)},
+        {"date", picojson::value((double)timestamp)},
+        {"body", picojson::value(unescape_html(text))},
+        {"out", picojson::value((flags & MESSAGE_FLAGS_OUTBOX) ? 1.0 : 0.0)},
+        {"read_state", picojson::value((flags & MESSAGE_FLAG_UNREAD) ? 0.0 : 1.0)},
+        {"attachments", attachments}
+    };
+    if (user_id < CHAT_ID_OFFSET) {
+        fields["user_id"] = picojson::value((double)user_id);
+    } else {
+        uint64 from_user_id = 0;
+        if (field_is_present<string>(extra, "from"))
+            from_user_id = atoll(extra.get("from").get<string>().data());
+        if (flags & MESSAGE_FLAGS_OUTBOX)
+            from_user_id = get_data(gc).self_user_id();
+        if (from_user_id == 0)
+            return false;
+        fields["user_id"] = picojson::value((double)from_user_id);
+        fields["chat_id"] = picojson::value((double)(user_id - CHAT_ID_OFFSET));
+    }
+
+    return receive_message_from_fields(gc, picojson::value(fields));
 }
 
-void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
+void process_online(PurpleConnection* gc, const LongPollUpdate& v, bool online)
 {
-    if (!v.contains(1) || !v.get(1).is<double>()) {
-        vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                           v.serialize().data());
+    if (!v.has_number(1)) {
+        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
         return;
     }
-    if (v.get(1).get<double>() > 0) {
-        vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                           v.serialize().data());
+    if (v.get(1).number > 0) {
+        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
         return;
     }
-    uint64 user_id = -v.get(1).get<double>();
+    uint64 user_id = -v.get(1).number;
     string name = user_name_from_id(user_id);
 
     vkcom_debug_info("User %s changed online to %d\n", name.data(), online);
@@ -490,12 +714,11 @@ void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
         }
 
         if (online) {
-            if (!v.contains(2) || !v.get(2).is<double>()) {
-                vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                                   v.serialize().data());
+            if (!v.has_number(2)) {
+                vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
                 return;
             }
-            uint64 platform = uint64(v.get(2).get<double>()) % 0x100;
+            uint64 platform = uint64(v.get(2).number) % 0x100;
 
             if (platform == PLATFORM_WEB) {
                 info->online = true;
@@ -506,7 +729,8 @@ void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
             }
 
             PurpleAccount* account = purple_connection_get_account(gc);
-            purple_prpl_got_user_login_time(account, name.data(), time(nullptr));
+            if (!dropped_in_replay(gc, "purple_prpl_got_user_login_time"))
+                purple_prpl_got_user_login_time(account, name.data(), time(nullptr));
         } else {
             info->online = false;
             info->online_mobile = false;
@@ -515,33 +739,32 @@ void process_online(PurpleConnection* gc, const picojson::value& v, bool online)
     }
 }
 
-void process_chat_update(PurpleConnection* gc, const picojson::value& v)
+void process_chat_update(PurpleConnection* gc, const LongPollUpdate& v)
 {
-    if (!v.contains(1) || !v.get(1).is<double>()) {
-        vkcom_debug_error("Strange respone form Long Poll in updates: %s\n",
-                          v.serialize().data());
+    if (!v.has_number(1)) {
+        vkcom_debug_error("Strange respone form Long Poll in updates: %s\n", v.raw().data());
         return;
     }
-    uint64 chat_id = v.get(1).get<double>();
+    uint64 chat_id = v.get(1).number;
 
     vkcom_debug_info("Updating parameters for chat %llu\n", (unsigned long long)chat_id);
 
     update_chat_infos(gc, { chat_id }, nullptr, true);
 }
 
-void process_typing(PurpleConnection* gc, const picojson::value& v)
+void process_typing(PurpleConnection* gc, const LongPollUpdate& v)
 {
-    if (!v.contains(1) || !v.get(1).is<double>()) {
-        vkcom_debug_error("Strange response from Long Poll in updates: %s\n",
-                           v.serialize().data());
+    if (!v.has_number(1)) {
+        vkcom_debug_error("Strange response from Long Poll in updates: %s\n", v.raw().data());
         return;
     }
-    uint64 user_id = v.get(1).get<double>();
+    uint64 user_id = v.get(1).number;
 
     add_buddy_if_needed(gc, user_id, [=] {
         // Vk.com documentation states, that "user is typing" messages are sent with ~10 second
         // interval between them. Let's make it 11, just to be sure.
-        serv_got_typing(gc, user_name_from_id(user_id).data(), 11, PURPLE_TYPING);
+        if (!dropped_in_replay(gc, "serv_got_typing"))
+            serv_got_typing(gc, user_name_from_id(user_id).data(), 11, PURPLE_TYPING);
     });
 }
 
@@ -552,4 +775,250 @@ void long_poll_fatal(PurpleConnection* gc)
                                    i18n("Unable to connect to Long Poll server"));
 }
 
+void long_poll_reconnect(PurpleConnection* gc, const char* reason)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.is_closing())
+        return;
+    VkLongPollState& state = gc_data.long_poll;
+
+    // Abandon the current request and all running chains of calls.
+    state.generation++;
+    state.request_running = false;
+    if (state.http_conn && purple_http_conn_is_running(state.http_conn))
+        purple_http_conn_cancel(state.http_conn);
+    state.http_conn = nullptr;
+
+    if (!state.down) {
+        state.down = true;
+        state.down_since = steady_clock::now();
+    }
+
+    if (state.failed_reconnects >= MAX_LONG_POLL_RECONNECTS) {
+        vkcom_debug_error("Failed to reconnect to Long Poll %u times\n", state.failed_reconnects);
+        long_poll_fatal(gc);
+        return;
+    }
+
+    if (!state.network_available) {
+        vkcom_debug_info("Long Poll connection lost (%s), waiting for network\n", reason);
+        state.waiting_for_network = true;
+        return;
+    }
+
+    unsigned delay = 0;
+    if (state.failed_reconnects > 0)
+        delay = std::min(1000u << state.failed_reconnects, MAX_LONG_POLL_RECONNECT_DELAY);
+    state.failed_reconnects++;
+    state.reconnect_count++;
+    vkcom_debug_info("Long Poll connection lost (%s), reconnecting in %u msec\n", reason, delay);
+
+    if (delay == 0) {
+        start_long_poll_impl(gc, load_last_msg_id(gc));
+    } else {
+        unsigned generation = state.generation;
+        timeout_add(gc, delay, [=] {
+            // Somebody else has reconnected already.
+            if (get_data(gc).long_poll.generation == generation)
+                start_long_poll_impl(gc, load_last_msg_id(gc));
+            return false;
+        });
+    }
+}
+
+void long_poll_error(PurpleConnection* gc, const char* reason)
+{
+    if (get_data(gc).long_poll.down)
+        long_poll_reconnect(gc, reason);
+    else
+        long_poll_fatal(gc);
+}
+
+void long_poll_restored(PurpleConnection* gc)
+{
+    VkLongPollState& state = get_data(gc).long_poll;
+    if (!state.down)
+        return;
+
+    steady_duration downtime = steady_clock::now() - state.down_since;
+    state.total_downtime += downtime;
+    state.down = false;
+    vkcom_debug_info("Long Poll connection restored after %d msec (%u reconnects, total downtime %d sec)\n",
+                     (int)to_milliseconds(downtime), state.reconnect_count,
+                     (int)to_seconds(state.total_downtime));
+}
+
+#if GLIB_CHECK_VERSION(2, 32, 0)
+// Called by GNetworkMonitor when network connectivity changes.
+void network_changed_cb(GNetworkMonitor*, gboolean available, gpointer user_data)
+{
+    PurpleConnection* gc = (PurpleConnection*)user_data;
+    VkLongPollState& state = get_data(gc).long_poll;
+    bool was_available = state.network_available;
+    state.network_available = available;
+    if (!available) {
+        vkcom_debug_info("Network is unavailable\n");
+        return;
+    }
+
+    if (state.waiting_for_network) {
+        state.waiting_for_network = false;
+        state.failed_reconnects = 0;
+        long_poll_reconnect(gc, "network is available again");
+        return;
+    }
+
+    // Network configuration has changed (e.g. we switched to another Wi-Fi network), the running
+    // request is most probably bound to the old connection and will hang until the watchdog fires.
+    if (state.request_running && (!was_available
+            || to_milliseconds(steady_clock::now() - state.request_time) > 1000))
+        long_poll_reconnect(gc, "network configuration changed");
+}
+#endif
+
+void start_long_poll_watchdog(PurpleConnection* gc)
+{
+    VkLongPollState& state = get_data(gc).long_poll;
+    state.network_available = true;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    GNetworkMonitor* monitor = g_network_monitor_get_default();
+    state.network_available = g_network_monitor_get_network_available(monitor);
+    state.network_changed_handler = g_signal_connect(monitor, "network-changed",
+                                                     G_CALLBACK(network_changed_cb), gc);
+#endif
+
+    timeout_add(gc, LONG_POLL_MARGIN * 1000, [=] {
+        VkLongPollState& cur_state = get_data(gc).long_poll;
+        if (cur_state.request_running && to_seconds(steady_clock::now() - cur_state.request_time)
+                >= LONG_POLL_WAIT + LONG_POLL_MARGIN)
+            long_poll_reconnect(gc, "no response from Long Poll server");
+        return true;
+    });
+}
+
+} // End of anonymous namespace
+
+namespace
+{
+
+// Helper struct for replay_long_poll_journal.
+struct JournalReplay
+{
+    vector<LongPollJournalRecord> records;
+    size_t next;
+    size_t num_updates;
+    steady_time_point start_time;
+    shared_ptr<ReplaySink> sink;
+};
+typedef shared_ptr<JournalReplay> JournalReplay_ptr;
+
+// Decodes all records with decode_long_poll_response and with picojson, which has been used before
+// the decoder, and logs the time taken by each. The decoder unescapes the strings as well, so that
+// both do the same work.
+void benchmark_long_poll_decoder(const vector<LongPollJournalRecord>& records)
+{
+    using std::chrono::microseconds;
+    using std::chrono::duration_cast;
+
+    // The sizes are summed up and logged, so that the compiler does not throw the results away.
+    size_t decoder_size = 0;
+    steady_time_point start_time = steady_clock::now();
+    for (const LongPollJournalRecord& record: records) {
+        const string& response = record.response;
+        LongPollResponse root;
+        decode_long_poll_response(response.data(), response.data() + response.size(), root);
+        for (const LongPollUpdate& update: root.updates)
+            for (size_t i = 0; i < update.size; i++)
+                if (update.fields[i].is_string())
+                    decoder_size += update.fields[i].str().size();
+    }
+    steady_duration decoder_time = steady_clock::now() - start_time;
+
+    size_t picojson_size = 0;
+    start_time = steady_clock::now();
+    for (const LongPollJournalRecord& record: records) {
+        picojson::value root;
+        const char* it = record.response.data();
+        picojson::parse(root, it, record.response.data() + record.response.size());
+        if (field_is_present<picojson::array>(root, "updates"))
+            picojson_size += root.get("updates").get<picojson::array>().size();
+    }
+    steady_duration picojson_time = steady_clock::now() - start_time;
+
+    vkcom_debug_info("Decoded %zu responses in %lld usec (%zu bytes of strings), picojson parsed them "
+                     "in %lld usec (%zu updates)\n", records.size(),
+                     (long long)duration_cast<microseconds>(decoder_time).count(), decoder_size,
+                     (long long)duration_cast<microseconds>(picojson_time).count(), picojson_size);
+}
+
+// Processes one record from the journal.
+void replay_journal_record(PurpleConnection* gc, JournalReplay& replay)
+{
+    const string& response = replay.records[replay.next].response;
+    replay.next++;
+
+    LongPollResponse root;
+    string error = decode_long_poll_response(response.data(), response.data() + response.size(), root);
+    if (!error.empty()) {
+        vkcom_debug_error("Error parsing %s: %s\n", response.data(), error.data());
+        return;
+    }
+
+    // Replayed messages must neither be ignored, nor update the stored last_msg_id. The events are
+    // processed in the sandbox, see ReplaySink.
+    LastMsg last_msg = { uint64(-1), 0 };
+    replay.sink->enter();
+    for (const LongPollUpdate& v: root.updates)
+        process_update(gc, v, last_msg);
+    replay.sink->leave();
+    replay.num_updates += root.updates.size();
+}
+
+// Processes the next record and schedules the following one according to recorded timestamps.
+void replay_journal_realtime(PurpleConnection* gc, const JournalReplay_ptr& replay)
+{
+    replay_journal_record(gc, *replay);
+    if (replay->next == replay->records.size()) {
+        vkcom_debug_info("Finished replaying Long Poll journal, %zu updates\n", replay->num_updates);
+        replay->sink->log_dropped();
+        return;
+    }
+
+    int64 delay = replay->records[replay->next].timestamp - replay->records[replay->next - 1].timestamp;
+    timeout_add(gc, (unsigned)std::max(delay, int64(0)), [=] {
+        replay_journal_realtime(gc, replay);
+        return false;
+    });
+}
+
 } // End of anonymous namespace
+
+void replay_long_poll_journal(PurpleConnection* gc, const string& path, bool realtime)
+{
+    JournalReplay_ptr replay{ new JournalReplay() };
+    read_long_poll_journal(path, replay->records);
+    if (replay->records.empty()) {
+        vkcom_debug_error("Long Poll journal %s is empty\n", path.data());
+        return;
+    }
+
+    vkcom_debug_info("Replaying %zu Long Poll responses from %s\n", replay->records.size(), path.data());
+    replay->next = 0;
+    replay->num_updates = 0;
+    replay->sink.reset(new ReplaySink(gc));
+    replay->start_time = steady_clock::now();
+    if (realtime) {
+        replay_journal_realtime(gc, replay);
+        return;
+    }
+
+    benchmark_long_poll_decoder(replay->records);
+
+    while (replay->next < replay->records.size())
+        replay_journal_record(gc, *replay);
+
+    steady_duration elapsed = steady_clock::now() - replay->start_time;
+    vkcom_debug_info("Replayed %zu responses (%zu updates) in %d msec\n", replay->records.size(),
+                     replay->num_updates, (int)to_milliseconds(elapsed));
+    replay->sink->log_dropped();
+}
@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include "common.h"
+
 #include <connection.h>
 
 // Long Poll in Vk.com terminology is a server, which pushes different events to you.
@@ -11,3 +13,14 @@
 // Initiates connection to Long Poll server and processes retrieved events. Long Poll update
 // loop terminates with termination of all HTTP connections, associated with gc.
 void start_long_poll(PurpleConnection* gc);
+
+// Unsubscribes from network connectivity notifications. Must be called upon closing connection.
+void stop_long_poll(PurpleConnection* gc);
+
+// Feeds Long Poll journal (recorded if long_poll_journal option is set) through the usual event
+// processing. If realtime is true, the responses are processed with the recorded intervals, otherwise
+// they are processed as fast as possible and the time taken is logged, along with the time taken
+// by decoding the responses with the Long Poll decoder and with picojson. Used for debugging and
+// benchmarking. The events are processed in a sandbox and do not reach the server or the user
+// (see ReplaySink), so the time taken covers only decoding and processing them.
+void replay_long_poll_journal(PurpleConnection* gc, const string& path, bool realtime);
@@ -5,14 +5,21 @@
 #include <server.h>
 #include <util.h>
 
+#include "httpcache.h"
 #include "httputils.h"
+#include "imageutils.h"
 #include "miscutils.h"
 #include "vk-api.h"
 #include "vk-buddy.h"
 #include "vk-chat.h"
 #include "vk-common.h"
+#include "vk-log-writer.h"
+#include "vk-message-sequencer.h"
+#include "vk-message-store.h"
+#include "vk-message-text.h"
 #include "vk-utils.h"
 #include "vk-smileys.h"
+#include "vk-thumbnail-images.h"
 
 #include "vk-message-recv.h"
 
@@ -20,13 +27,23 @@
 namespace
 {
 
-// The amount of messages to synchronize when logging in for the first time.
+// The amount of messages in each direction to synchronize when logging in for the first time.
 const uint64 MAX_MESSAGES_ON_FIRST_TIME = 5000;
-
-// Function, which returns the last message id, which the user received. It is used to calculate
-// message id, which we start receiving messages from.
-typedef function_ptr<void(uint64 msg_id)> LastMessageIdCb;
-void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb);
+// The amount of messages, requested from messages.get at once. History is processed in chunks
+// of the same size.
+const size_t HISTORY_PAGE_SIZE = 200;
+// The number of messages, by which consecutive pages of messages.get overlap. See HistoryStream.
+const size_t HISTORY_PAGE_OVERLAP = 10;
+
+// Thumbnails, which have not been downloaded in this time, are replaced by links (in msec).
+const unsigned THUMBNAIL_DOWNLOADS_DEADLINE = 15000;
+
+// Prepended to every line of forwarded message once per nesting level.
+const char FWD_QUOTE_PREFIX[] = "    > ";
+// Messages, forwarded deeper than this, are not shown.
+const unsigned MAX_FWD_DEPTH = 32;
+// The number of formatted dates, kept by timestamp_to_long_format.
+const size_t MAX_CACHED_DATES = 256;
 
 enum MessageStatus {
     MESSAGE_INCOMING_READ,
@@ -40,15 +57,16 @@ struct Message
     uint64 mid;
     uint64 user_id;
     uint64 chat_id; // If chat_id is 0, this is a regular instant message.
-    string text;
+    MessageText text;
     time_t timestamp;
     MessageStatus status;
 
     // A list of thumbnail URLs to download and append to message. Set in process_attachments,
-    // replaced in download_thumbnails.
+    // imgstore ids are set in download_thumbnails (0 if the thumbnail has not been downloaded).
     vector<string> thumbnail_urls;
-    // A list of user and group ids, used in the message. Set in process_attachments
-    // and process_fwd_message, replaced in replace_user_ids and replace_group_ids.
+    vector<int> thumbnail_img_ids;
+    // A list of unknown user and group ids, used in the message. Set in process_attachments
+    // and process_fwd_message, information is requested in replace_user_ids and replace_group_ids.
     vector<uint64> unknown_user_ids;
     vector<uint64> unknown_group_ids;
 };
@@ -58,89 +76,270 @@ struct MessagesData
 {
     PurpleConnection* gc;
     ReceivedCb received_cb;
+    // Set for older messages, downloaded by the history backfill. They are written to new logs,
+    // which start at the time of the oldest message, so that the logs are listed in the right order.
+    bool history;
+    // The number of stages of receive_message_infos, which have not finished yet.
+    unsigned stages_running;
 
     vector<Message> messages;
 };
 typedef shared_ptr<MessagesData> MessagesData_ptr;
 
-// Receives all messages starting after last_msg_id.
-void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_msg_id, bool outgoing);
+// One sequence of messages from messages.get (e.g. all outgoing messages after last_msg_id).
+// We want to process messages from the oldest ones, so that the logs are written in the right
+// order, and keep only one page of each stream in memory. messages.get returns the newest messages
+// first and offsets count from the newest message, so the first request at offset 0 returns
+// the total count and the pages are then requested from the oldest one toward offset 0.
+//
+// Messages, which arrive during the synchronization, shift the following pages to the older ones,
+// so consecutive pages overlap by HISTORY_PAGE_OVERLAP messages and the duplicates are dropped.
+// Messages, which are read (for the unread messages) or deleted, shift them to the newer ones: if
+// the page does not reach the newest message received so far, there might be a gap and the page
+// is requested again from a greater offset. Similarly, if the stream has grown before its oldest
+// page has been received, the oldest page is requested again.
+struct HistoryStream
+{
+    CallParams params;
+    // Offset of the next page to request.
+    size_t next_offset;
+    // Id of the newest message received so far, zero if nothing has been received yet.
+    uint64 newest_msg_id;
+    // Messages of the current page, which have not been merged yet, ordered from the newest
+    // to the oldest one.
+    picojson::array messages;
+    // Set when the page at offset 0 has been received.
+    bool finished;
+    // Set on the first login if the stream has more than MAX_MESSAGES_ON_FIRST_TIME messages and
+    // only the latest ones are received.
+    bool truncated;
+};
+
+// State of receive_messages_range. Messages are received in two phases: first, all unread incoming
+// messages are received and shown to the user. Second, incoming and outgoing messages are merged
+// by id and written to logs or open conversations. Merged messages are processed in chunks.
+struct HistorySync
+{
+    PurpleConnection* gc;
+    ReceivedCb received_cb;
+    // Zero on the first login, when messages.get is called without last_message_id.
+    uint64 last_msg_id;
+    bool unread_phase;
+    // Incremented when a phase starts or finishes, so that the responses for the streams
+    // of the previous phase are ignored (pages of all streams are requested at once).
+    unsigned phase_num;
+    // Messages with lesser ids are skipped in the second phase. On the first login, it is the first
+    // id, which all truncated streams contain, and is found when their oldest pages are received.
+    uint64 first_msg_id;
+    bool first_msg_id_found;
+
+    vector<HistoryStream> streams;
+    // Messages, which will be processed together (downloading thumbnails, user infos etc.).
+    MessagesData_ptr chunk;
+    // Id of the last message, added to chunk during the current phase. Merged streams are sorted,
+    // so anything less or equal is a duplicate.
+    uint64 merged_msg_id;
+    // Unread messages, received in the first phase. They must not be received again in the second one.
+    set<uint64> unread_msg_ids;
+    uint64 max_msg_id;
+};
+typedef shared_ptr<HistorySync> HistorySync_ptr;
+
+// Starts the given phase of synchronization.
+void start_history_phase(const HistorySync_ptr& sync, bool unread_phase);
+// Receives the next pages of the streams, which have been merged completely, then merges the pages
+// into the next chunk and processes it. Messages are merged only while every unfinished stream has
+// a page, so that no older message can come later. Repeats until all messages have been processed.
+void continue_history_sync(const HistorySync_ptr& sync);
+// Requests the next page of the stream and calls done_cb after it has been received.
+void receive_history_page(const HistorySync_ptr& sync, size_t stream_num, const SuccessCb& done_cb);
+// Returns true if the page connects to the messages, which have been received before, or to the
+// oldest end of the stream. count is the stream size, returned along with the page.
+bool check_history_page(const HistorySync_ptr& sync, HistoryStream& stream, const picojson::array& items,
+                        size_t count);
+// Processes the chunk and calls continue_history_sync when it has been processed.
+void process_history_chunk(const HistorySync_ptr& sync);
+// Called when either all streams have finished or an error has occurred.
+void finish_history_phase(const HistorySync_ptr& sync, bool success);
 
 // Processes one item from the result of messages.get and messages.getById.
 void process_message(const MessagesData_ptr& data, const picojson::value& fields);
 // Processes attachments: appends urls to message text, adds thumbnail_urls.
 void process_attachments(PurpleConnection* gc, const picojson::array& items, Message& message);
-// Processes forwarded messages: appends message text and processes attachments.
-void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Message& message);
-// Processes photo attachment.
-void process_photo_attachment(const picojson::value& fields, Message& message,
-                              const VkOptions& options);
-// Processes video attachment.
-void process_video_attachment(const picojson::value& fields, Message& message,
-                              const VkOptions& options);
-// Processes audio attachment.
-void process_audio_attachment(const picojson::value& fields, Message& message);
-// Processes doc attachment.
-void process_doc_attachment(const picojson::value& fields, Message& message, const VkOptions& options);
-// Processes wall post attachment.
-void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields, Message& message);
-// Processes link attachment.
-void process_link_attachment(const picojson::value& fields, Message& message, const VkOptions& options);
-// Processes album attachment.
-void process_album_attachment(const picojson::value& fields, Message& message);
-// Processes sticker attachment.
-void process_sticker_attachment(const picojson::value& fields, Message& message, const VkOptions& options);
-// Processes gift attachment.
-void process_gift_attachment(const picojson::value& fields, Message& message, const VkOptions& options);
+// Processes forwarded messages: appends message text and processes attachments. Messages, forwarded
+// in the forwarded one, are processed recursively, depth is the nesting level (1 for messages,
+// forwarded in the received one).
+void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Message& message,
+                         unsigned depth = 1);
+// Appends text to out, prepending prefix to every line but the first one.
+void append_quoted(MessageText& out, const string& text, const string& prefix);
+
+// Attachment types, which we know how to render. Attachment type strings are mapped to these once
+// in intern_attachment_type and are used as index into attachment_renderers.
+enum AttachmentType {
+    ATTACHMENT_PHOTO,
+    ATTACHMENT_VIDEO,
+    ATTACHMENT_AUDIO,
+    ATTACHMENT_DOC,
+    ATTACHMENT_WALL,
+    ATTACHMENT_LINK,
+    ATTACHMENT_ALBUM,
+    ATTACHMENT_STICKER,
+    ATTACHMENT_GIFT,
+    ATTACHMENT_UNKNOWN
+};
+
+enum FieldKind {
+    FIELD_NUMBER,
+    FIELD_STRING
+};
+
+struct RequiredField
+{
+    const char* name;
+    FieldKind kind;
+};
+
+const size_t MAX_REQUIRED_FIELDS = 4;
+// Values of required fields in the order of declaration in AttachmentRenderer.
+typedef const picojson::value* AttachmentFields[MAX_REQUIRED_FIELDS];
+
+// Renderer appends the attachment to the message text. It is called only if all required fields
+// are present and have correct types.
+typedef void (*AttachmentRenderFn)(PurpleConnection* gc, const picojson::value& fields,
+                                   const AttachmentFields& values, Message& message,
+                                   const VkOptions& options);
+
+struct AttachmentRenderer
+{
+    // Unused fields have nullptr name.
+    RequiredField required[MAX_REQUIRED_FIELDS];
+    AttachmentRenderFn render;
+};
+
+// Returns attachment type for the type string from Vk.com or ATTACHMENT_UNKNOWN.
+AttachmentType intern_attachment_type(const string& type);
+// Looks up all required fields of the given attachment type in fields. Returns false if any one
+// of them is absent or has a wrong type.
+bool get_required_fields(AttachmentType type, const picojson::value& fields, AttachmentFields& values);
+// Checks the required fields and calls the renderer.
+void render_attachment(PurpleConnection* gc, AttachmentType type, const picojson::value& fields,
+                       Message& message, const VkOptions& options);
+// Appends <a href='url'>title</a> to text.
+void append_link(MessageText& text, const string& url, const string& title);
+
+// Size variant of a thumbnail: the field with its URL and the bigger side of the image (in pixels).
+struct ThumbnailVariant
+{
+    const char* name;
+    int size;
+};
+// Returns URL of the biggest variant, which fits into max_size x max_size box, or of the smallest
+// present one if none does. variants are ordered by size and end with nullptr name. Returns fallback
+// if max_size is zero or less or no variants are present.
+string select_thumbnail(const picojson::value& fields, const ThumbnailVariant* variants, int max_size,
+                        const string& fallback);
+
+// Renderers for each attachment type.
+void process_photo_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                              Message& message, const VkOptions& options);
+void process_video_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                              Message& message, const VkOptions& options);
+void process_audio_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                              Message& message, const VkOptions& options);
+void process_doc_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                            Message& message, const VkOptions& options);
+// Wall posts include reposted posts (copy_history), which are rendered recursively.
+void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                             Message& message, const VkOptions& options);
+void process_link_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                             Message& message, const VkOptions& options);
+void process_album_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                              Message& message, const VkOptions& options);
+void process_sticker_attachment(PurpleConnection* gc, const picojson::value& fields,
+                                const AttachmentFields& values, Message& message, const VkOptions& options);
+void process_gift_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                             Message& message, const VkOptions& options);
 // Processes geo: appends link to the map.
 void process_geo(const picojson::value& fields, Message& message);
 
-// Appends specific thumbnail placeholder to the end of message text. Placeholder will be replaced
-// by actual image later in download_thumbnail(). If prepend_br is false, <br> is prepended only
-// when message text is not empty.
+// Appends thumbnail hole to the end of message text. The thumbnail is downloaded later
+// in download_thumbnails(). If prepend_br is false, <br> is prepended only when message text
+// is not empty.
 void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
                                   const VkOptions& options, bool prepend_br = true);
-// Returns user/group placeholder, which should be appended to the message text. It will
-// be replaced with actual user/group name and link to the page later in replace_user/group_ids().
-string get_user_placeholder(PurpleConnection* gc, uint64 user_id, Message& message);
-string get_group_placeholder(PurpleConnection* gc, uint64 group_id, Message& message);
-
-// Downloads the given thumbnail for given message, modifies corresponding message text
-// and calls either next download_thumbnail() or finish(). message is index into m_messages,
-// thumbnail is index into thumbnail_urls.
-void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thumb_num);
-// Replaces all placeholder texts for user/group ids in messages with user/group names
-// and hrefs. Gets information on users, which are not present in user_infos, and groups
-// from vk.com
+// Appends user/group hole to text. Information about unknown users/groups is requested later
+// in replace_user/group_ids(), the holes are replaced with names and links to the pages
+// in render_message_text().
+void append_user_placeholder(PurpleConnection* gc, uint64 user_id, MessageText& text, Message& message);
+void append_group_placeholder(PurpleConnection* gc, uint64 group_id, MessageText& text, Message& message);
+// Resolves all the holes in message text. Downloaded thumbnails are inserted as imgstore images
+// if inline_thumbnails is true and as links otherwise.
+string render_message_text(PurpleConnection* gc, const Message& message, bool inline_thumbnails = true);
+// Returns the message in the form, which is kept in the message store. text is the rendered text.
+StoredMessage make_stored_message(PurpleConnection* gc, const Message& message, const string& text);
+// Returns the author name, which is written to conversation or log.
+string get_author_display_name(PurpleConnection* gc, const Message& message);
+
+// Gets everything, which is needed to show the messages, and calls finish_receiving. The stages
+// below do not depend on each other, so they are run concurrently and the messages are shown
+// as soon as the slowest one has finished.
+void receive_message_infos(const MessagesData_ptr& data);
+// Called by each stage when it has finished.
+void finish_stage(const MessagesData_ptr& data);
+// Downloads all thumbnails for all messages concurrently (no more than thumbnail_downloads_per_host
+// downloads to one host at once) and sets thumbnail_img_ids. Thumbnails, which have not been
+// downloaded before the deadline, are shown as links.
+void download_thumbnails(const MessagesData_ptr& data);
+// Gets information on unknown users, mentioned in messages, and authors of incoming messages
+// (we need their real names when we write to the log), then adds authors of unread messages
+// to the buddy list.
 void replace_user_ids(const MessagesData_ptr& data);
+// Gets information on unknown groups, mentioned in messages.
 void replace_group_ids(const MessagesData_ptr& data);
-// Adds all users and groups which are senders/receiveirs of message (needed to get their names/open
-// conversation with them).
-void add_unknown_users_chats(const MessagesData_ptr& data);
-// Sorts received messages, sends them to libpurple client and destroys this.
+// Gets information on chats of incoming messages and adds chats with unread messages to the buddy
+// list (needed to open conversations with them).
+void add_unknown_chats(const MessagesData_ptr& data);
+
+// Sorts messages by id and removes duplicates. Messages arrive in pages, which are already sorted
+// (history chunks are merged by id), so instead of sorting the whole batch, the ascending runs are
+// merged. A single run (the common case) is only checked for duplicates.
+void merge_message_runs(vector<Message>& messages);
+// Sorts received messages, sends them to libpurple client and destroys this. Messages, received
+// in background while Long Poll is running, are written in order with the ones from Long Poll,
+// see vk-message-sequencer.h.
 void finish_receiving(const MessagesData_ptr& data);
+// Writes one rendered message to the conversation or to the log.
+void write_received_message(PurpleConnection* gc, MessageStatus status, uint64 user_id, uint64 chat_id,
+                            const string& text, const StoredMessage& stored, bool history, time_t log_time);
 
 } // End of anonymous namespace
 
 void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb)
 {
-    MessagesData_ptr data{ new MessagesData };
+    HistorySync_ptr sync{ new HistorySync() };
+    sync->gc = gc;
+    sync->received_cb = received_cb;
+    sync->max_msg_id = 0;
+    sync->last_msg_id = last_msg_id;
+    sync->phase_num = 0;
+    sync->first_msg_id = last_msg_id + 1;
+    sync->first_msg_id_found = last_msg_id != 0;
+    start_history_phase(sync, true);
+}
+
+void receive_history_messages(PurpleConnection* gc, const picojson::array& items, const SuccessCb& done_cb)
+{
+    MessagesData_ptr data{ new MessagesData() };
     data->gc = gc;
-    data->received_cb = received_cb;
-
-    if (last_msg_id == 0) {
-        // The user has logged in from this computer for the first time. Do not download the
-        // whole history, but get the last message id and download no more than MAX_MESSAGES_ON_FIRST_TIME
-        // before it.
-        get_last_message_id(gc, [=](uint64 real_last_msg_id) {
-            uint64 start_msg_id = 0;
-            if (real_last_msg_id > MAX_MESSAGES_ON_FIRST_TIME)
-                start_msg_id = real_last_msg_id - MAX_MESSAGES_ON_FIRST_TIME;
-            receive_messages_range_internal(data, start_msg_id, false);
-        });
-    } else {
-        receive_messages_range_internal(data, last_msg_id, false);
-    }
+    data->received_cb = [=](uint64) {
+        done_cb();
+    };
+    data->history = true;
+
+    for (const picojson::value& fields: items)
+        process_message(data, fields);
+    receive_message_infos(data);
 }
 
 void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
@@ -156,7 +355,7 @@ void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
     vk_call_api_items(data->gc, "messages.getById", params, false, [=](const picojson::value& message) {
         process_message(data, message);
     }, [=] {
-        download_thumbnail(data, 0, 0);
+        receive_message_infos(data);
     }, [=](const picojson::value&) {
         finish_receiving(data);
     });
@@ -165,44 +364,281 @@ void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids)
 namespace
 {
 
-void get_last_message_id(PurpleConnection* gc, LastMessageIdCb last_message_id_cb)
+// Returns true if all attachments can be rendered without calling messages.getById. We accept
+// only plain photos and stickers and check the fields, which their renderers require.
+bool attachments_complete(const picojson::array& items)
 {
-    CallParams params = { {"code", "return API.messages.get({\"count\": 1}).items[0].id;" } };
-    vk_call_api(gc, "execute", params, [=](const picojson::value& v) {
-        if (!v.is<double>()) {
-            vkcom_debug_error("Strange response from messages.get: %s\n",
-                               v.serialize().data());
-            last_message_id_cb(0);
-            return;
+    for (const picojson::value& v: items) {
+        if (!field_is_present<string>(v, "type"))
+            return false;
+        const string& type = v.get("type").get<string>();
+        if (!field_is_present<picojson::object>(v, type))
+            return false;
+
+        AttachmentType attachment_type = intern_attachment_type(type);
+        if (attachment_type != ATTACHMENT_PHOTO && attachment_type != ATTACHMENT_STICKER)
+            return false;
+        AttachmentFields values;
+        if (!get_required_fields(attachment_type, v.get(type), values))
+            return false;
+    }
+    return true;
+}
+
+} // End of anonymous namespace
+
+bool receive_message_from_fields(PurpleConnection* gc, const picojson::value& fields)
+{
+    if (!field_is_present<picojson::array>(fields, "attachments") || fields.contains("fwd_messages")
+            || fields.contains("geo"))
+        return false;
+    if (!attachments_complete(fields.get("attachments").get<picojson::array>()))
+        return false;
+
+    MessagesData_ptr data{ new MessagesData() };
+    data->gc = gc;
+    data->received_cb = nullptr;
+
+    process_message(data, fields);
+    if (data->messages.empty())
+        return false;
+
+    receive_message_infos(data);
+    return true;
+}
+
+namespace
+{
+
+uint64 get_message_id(const picojson::value& fields)
+{
+    if (!field_is_present<double>(fields, "id"))
+        return 0;
+    return fields.get("id").get<double>();
+}
+
+void start_history_phase(const HistorySync_ptr& sync, bool unread_phase)
+{
+    vkcom_debug_info("Receiving %s messages starting from %llu\n", unread_phase ? "unread" : "all",
+                     (unsigned long long)sync->last_msg_id + 1);
+
+    sync->unread_phase = unread_phase;
+    sync->phase_num++;
+    sync->merged_msg_id = 0;
+    sync->streams.clear();
+    if (unread_phase) {
+        // filters=1 means only unread messages.
+        sync->streams.resize(1);
+        sync->streams[0].params = { {"out", "0"}, {"filters", "1"} };
+    } else {
+        sync->streams.resize(2);
+        sync->streams[0].params = { {"out", "0"} };
+        sync->streams[1].params = { {"out", "1"} };
+    }
+    for (HistoryStream& stream: sync->streams) {
+        stream.params.emplace_back("count", to_string(HISTORY_PAGE_SIZE));
+        if (sync->last_msg_id != 0)
+            stream.params.emplace_back("last_message_id", to_string(sync->last_msg_id));
+        stream.next_offset = 0;
+        stream.newest_msg_id = 0;
+        stream.finished = false;
+        stream.truncated = false;
+    }
+
+    continue_history_sync(sync);
+}
+
+void continue_history_sync(const HistorySync_ptr& sync)
+{
+    // The next pages of all streams, which have been merged completely, are requested at once.
+    vector<size_t> merged_streams;
+    for (size_t i = 0; i < sync->streams.size(); i++)
+        if (!sync->streams[i].finished && sync->streams[i].messages.empty())
+            merged_streams.push_back(i);
+    if (!merged_streams.empty()) {
+        shared_ptr<size_t> remaining{ new size_t(merged_streams.size()) };
+        for (size_t i: merged_streams) {
+            receive_history_page(sync, i, [=] {
+                (*remaining)--;
+                if (*remaining == 0)
+                    continue_history_sync(sync);
+            });
         }
+        return;
+    }
 
-        last_message_id_cb(v.get<double>());
-    }, [=](const picojson::value&) {
-        last_message_id_cb(0);
-    });
+    // On the first login, only the latest messages are merged. The older messages will be
+    // downloaded in background, see vk-backfill.h. The truncated streams hold their oldest pages
+    // at this point.
+    if (!sync->unread_phase && !sync->first_msg_id_found) {
+        for (const HistoryStream& stream: sync->streams)
+            if (stream.truncated && !stream.messages.empty())
+                sync->first_msg_id = std::max(sync->first_msg_id, get_message_id(stream.messages.back()));
+        sync->first_msg_id_found = true;
+        get_data(sync->gc).backfill.start_msg_id = sync->first_msg_id;
+    }
+
+    if (!sync->chunk) {
+        sync->chunk.reset(new MessagesData());
+        sync->chunk->gc = sync->gc;
+    }
+
+    bool page_needed = false;
+    while (sync->chunk->messages.size() < HISTORY_PAGE_SIZE) {
+        // Choose the stream with the least message id.
+        HistoryStream* next = nullptr;
+        for (HistoryStream& stream: sync->streams) {
+            if (stream.messages.empty()) {
+                // The next page of the stream may have older messages than the other streams.
+                if (!stream.finished)
+                    page_needed = true;
+                continue;
+            }
+            if (!next || get_message_id(stream.messages.back()) < get_message_id(next->messages.back()))
+                next = &stream;
+        }
+        // All messages have been merged or we have to wait for the next page.
+        if (!next || page_needed)
+            break;
+
+        picojson::value fields = std::move(next->messages.back());
+        next->messages.pop_back();
+
+        uint64 msg_id = get_message_id(fields);
+        if (msg_id > sync->merged_msg_id && !contains(sync->unread_msg_ids, msg_id)
+                && (sync->unread_phase || msg_id >= sync->first_msg_id)) {
+            sync->merged_msg_id = msg_id;
+            sync->max_msg_id = std::max(sync->max_msg_id, msg_id);
+            if (sync->unread_phase)
+                sync->unread_msg_ids.insert(msg_id);
+            process_message(sync->chunk, fields);
+        }
+    }
+
+    if (!sync->chunk->messages.empty())
+        process_history_chunk(sync);
+    else if (page_needed)
+        continue_history_sync(sync);
+    else
+        finish_history_phase(sync, true);
 }
 
-void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_msg_id, bool outgoing)
+void receive_history_page(const HistorySync_ptr& sync, size_t stream_num, const SuccessCb& done_cb)
 {
-    vkcom_debug_info("Receiving %s messages starting from %llu\n",
-                      outgoing ? "outgoing" : "incoming", (unsigned long long)last_msg_id + 1);
+    const HistoryStream& stream = sync->streams[stream_num];
+    CallParams params = stream.params;
+    params.emplace_back("offset", to_string(stream.next_offset));
+    unsigned phase_num = sync->phase_num;
+    vk_call_api(sync->gc, "messages.get", params, [=](const picojson::value& result) {
+        // Another stream has failed and the phase has finished.
+        if (sync->phase_num != phase_num)
+            return;
+        if (!field_is_present<picojson::array>(result, "items")
+                || !field_is_present<double>(result, "count")) {
+            vkcom_debug_error("Strange response from messages.get: %s\n", result.serialize().data());
+            finish_history_phase(sync, false);
+            return;
+        }
+
+        // The reference could have been invalidated, take it again.
+        HistoryStream& current = sync->streams[stream_num];
+        const picojson::array& items = result.get("items").get<picojson::array>();
+        size_t count = result.get("count").get<double>();
+        if (!check_history_page(sync, current, items, count)) {
+            vkcom_debug_info("Messages have been added or removed during synchronization, requesting "
+                             "another page\n");
+            receive_history_page(sync, stream_num, done_cb);
+            return;
+        }
 
-    CallParams params = { {"out", outgoing ? "1" : "0"}, {"count", "200"},
-                          {"last_message_id", to_string(last_msg_id) } };
+        // Consecutive pages overlap, the messages, which have been received already, are dropped.
+        for (const picojson::value& fields: items)
+            if (get_message_id(fields) > current.newest_msg_id)
+                current.messages.push_back(fields);
+        if (!items.empty())
+            current.newest_msg_id = std::max(current.newest_msg_id, get_message_id(items.front()));
 
-    vk_call_api_items(data->gc, "messages.get", params, true, [=](const picojson::value& message) {
-        process_message(data, message);
-    }, [=] {
-        vkcom_debug_info("Finished processing %s messages\n", outgoing ? "outgoing" : "incoming");
-        if (!outgoing)
-            receive_messages_range_internal(data, last_msg_id, true);
+        if (current.next_offset == 0)
+            current.finished = true;
         else
-            download_thumbnail(data, 0, 0);
+            current.next_offset -= std::min(current.next_offset, HISTORY_PAGE_SIZE - HISTORY_PAGE_OVERLAP);
+        done_cb();
     }, [=](const picojson::value&) {
-        finish_receiving(data);
+        if (sync->phase_num == phase_num)
+            finish_history_phase(sync, false);
     });
 }
 
+bool check_history_page(const HistorySync_ptr& sync, HistoryStream& stream, const picojson::array& items,
+                        size_t count)
+{
+    if (stream.newest_msg_id == 0) {
+        // The user has logged in from this computer for the first time. Do not download the whole
+        // history, only the latest messages.
+        if (sync->last_msg_id == 0 && count > MAX_MESSAGES_ON_FIRST_TIME) {
+            count = MAX_MESSAGES_ON_FIRST_TIME;
+            stream.truncated = true;
+        }
+        // The page must be the oldest one. A page, which is not full, is the oldest anyway.
+        if (count <= stream.next_offset + items.size() || items.size() < HISTORY_PAGE_SIZE)
+            return true;
+        stream.next_offset = count - HISTORY_PAGE_SIZE;
+        return false;
+    }
+
+    // The page must reach the newest message received so far or the oldest end of the stream,
+    // otherwise the messages between them might be missing.
+    bool oldest_page = count <= stream.next_offset + items.size();
+    if (oldest_page || (!items.empty() && get_message_id(items.back()) <= stream.newest_msg_id))
+        return true;
+    if (items.empty())
+        stream.next_offset = count - std::min(count, HISTORY_PAGE_SIZE);
+    else
+        stream.next_offset += HISTORY_PAGE_SIZE - HISTORY_PAGE_OVERLAP;
+    return false;
+}
+
+void process_history_chunk(const HistorySync_ptr& sync)
+{
+    MessagesData_ptr chunk = sync->chunk;
+    sync->chunk.reset();
+    chunk->received_cb = [=](uint64) {
+        continue_history_sync(sync);
+    };
+    receive_message_infos(chunk);
+}
+
+void finish_history_phase(const HistorySync_ptr& sync, bool success)
+{
+    vkcom_debug_info("Finished receiving %s messages\n", sync->unread_phase ? "unread" : "all");
+    sync->phase_num++;
+    sync->streams.clear();
+
+    // Messages, which have already been merged, must be shown even on error.
+    if (sync->chunk && !sync->chunk->messages.empty()) {
+        MessagesData_ptr chunk = sync->chunk;
+        sync->chunk.reset();
+        chunk->received_cb = [=](uint64) {
+            finish_history_phase(sync, success);
+        };
+        receive_message_infos(chunk);
+        return;
+    }
+    sync->chunk.reset();
+
+    if (sync->unread_phase) {
+        // Unread messages will be received along with the rest if this phase has failed.
+        start_history_phase(sync, false);
+        return;
+    }
+
+    // Messages are merged in the order of ids, so if the second phase has failed, all the messages
+    // up to merged_msg_id have been received and we should continue from it next time.
+    uint64 max_msg_id = success ? sync->max_msg_id : sync->merged_msg_id;
+    if (sync->received_cb)
+        sync->received_cb(max_msg_id);
+}
+
 
 // NOTE:
 //  * We must escape text, otherwise we cannot receive comment, containing &amp; or <br>
@@ -211,17 +647,61 @@ void receive_messages_range_internal(const MessagesData_ptr& data, uint64 last_m
 //  * Smileys are returned as Unicode emoji.
 string cleanup_message_body(const string& body)
 {
-    char* escaped = purple_markup_escape_text(body.data(), -1);
-    string ret = escaped;
-    g_free(escaped);
-    convert_incoming_smileys(ret);
-    return ret;
+    return escape_incoming_text(body);
 }
 
-// Converts timestamp, received from server, to string in local time.
+// Converts timestamp, received from server, to string in local time. Long threads of forwarded
+// messages and reposts often carry the same dates, so the formatted strings are cached. The string
+// is returned by value, because the cache is cleared when it grows too large.
 string timestamp_to_long_format(time_t timestamp)
 {
-    return purple_date_format_long(localtime(&timestamp));
+    static map<time_t, string> cache;
+    auto it = cache.find(timestamp);
+    if (it != cache.end())
+        return it->second;
+
+    if (cache.size() >= MAX_CACHED_DATES)
+        cache.clear();
+    return cache[timestamp] = purple_date_format_long(localtime(&timestamp));
+}
+
+// Parts of the translated forwarded message header around the user link and the date. The string
+// is the same for all messages, so it is split only once.
+struct FwdHeaderFormat
+{
+    string before_user;
+    string between;
+    string after_date;
+    // Set if the translation puts the date before the user.
+    bool date_first;
+};
+
+const FwdHeaderFormat& get_fwd_header_format()
+{
+    static FwdHeaderFormat format;
+    static bool initialized = false;
+    if (initialized)
+        return format;
+    initialized = true;
+
+    // The user and the date go in the middle of translated string, so we mark their positions
+    // and split the string there.
+    string header = str_format(i18n("Forwarded message (from %s on %s):\n"), "\x01", "\x02");
+    size_t user_pos = header.find('\x01');
+    size_t date_pos = header.find('\x02');
+    if (user_pos == string::npos || date_pos == string::npos) {
+        vkcom_debug_error("Strange translation of forwarded message header: %s\n", header.data());
+        header = str_format("Forwarded message (from %s on %s):\n", "\x01", "\x02");
+        user_pos = header.find('\x01');
+        date_pos = header.find('\x02');
+    }
+    format.date_first = date_pos < user_pos;
+    size_t first = std::min(user_pos, date_pos);
+    size_t second = std::max(user_pos, date_pos);
+    format.before_user = header.substr(0, first);
+    format.between = header.substr(first + 1, second - first - 1);
+    format.after_date = header.substr(second + 1);
+    return format;
 }
 
 void process_message(const MessagesData_ptr& data, const picojson::value& fields)
@@ -240,8 +720,13 @@ void process_message(const MessagesData_ptr& data, const picojson::value& fields
     message.chat_id = 0;
     if (field_is_present<double>(fields, "chat_id"))
         message.chat_id = fields.get("chat_id").get<double>();
+    // Unread messages, received on the first login, can be older than the history download start
+    // and have already been written.
+    if (data->history && get_message_store(data->gc).contains(peer_id_from_ids(message.user_id, message.chat_id),
+                                                              message.mid))
+        return;
 
-    message.text = cleanup_message_body(fields.get("body").get<string>());
+    message.text += cleanup_message_body(fields.get("body").get<string>());
     message.timestamp = fields.get("date").get<double>();
     if (fields.get("out").get<double>() != 0.0)
         message.status = MESSAGE_OUTGOING;
@@ -249,6 +734,9 @@ void process_message(const MessagesData_ptr& data, const picojson::value& fields
         message.status = MESSAGE_INCOMING_UNREAD;
     else
         message.status = MESSAGE_INCOMING_READ;
+    // Old unread messages are of no interest to the user, they should not pop up in conversations.
+    if (data->history && message.status == MESSAGE_INCOMING_UNREAD)
+        message.status = MESSAGE_INCOMING_READ;
 
     // Process attachments: append information to text.
     if (field_is_present<picojson::array>(fields, "attachments"))
@@ -268,6 +756,7 @@ void process_message(const MessagesData_ptr& data, const picojson::value& fields
 
 void process_attachments(PurpleConnection* gc, const picojson::array& items, Message& message)
 {
+    const VkOptions& options = get_data(gc).options();
     for (const picojson::value& v: items) {
         if (!field_is_present<string>(v, "type")) {
             vkcom_debug_error("Strange response from messages.get or messages.getById: %s\n",
@@ -285,26 +774,8 @@ void process_attachments(PurpleConnection* gc, const picojson::array& items, Mes
         if (!message.text.empty())
             message.text += "<br>";
 
-        const VkOptions& options = get_data(gc).options();
-        if (type == "photo") {
-            process_photo_attachment(fields, message, options);
-        } else if (type == "video") {
-            process_video_attachment(fields, message, options);
-        } else if (type == "audio") {
-            process_audio_attachment(fields, message);
-        } else if (type == "doc") {
-            process_doc_attachment(fields, message, options);
-        } else if (type == "wall") {
-            process_wall_attachment(gc, fields, message);
-        } else if (type == "link") {
-            process_link_attachment(fields, message, options);
-        } else if (type == "album") {
-            process_album_attachment(fields, message);
-        } else if (type == "sticker") {
-            process_sticker_attachment(fields, message, options);
-        } else if (type == "gift") {
-            process_gift_attachment(fields, message, options);
-        } else {
+        AttachmentType attachment_type = intern_attachment_type(type);
+        if (attachment_type == ATTACHMENT_UNKNOWN) {
             vkcom_debug_error("Strange attachment in response from messages.get "
                                "or messages.getById: type %s, %s\n", type.data(), fields.serialize().data());
             message.text += "\n";
@@ -312,10 +783,12 @@ void process_attachments(PurpleConnection* gc, const picojson::array& items, Mes
             message.text += type;
             continue;
         }
+        render_attachment(gc, attachment_type, fields, message, options);
     }
 }
 
-void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Message& message)
+void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Message& message,
+                         unsigned depth)
 {
     if (!field_is_present<double>(fields, "user_id") || !field_is_present<double>(fields, "date")
             || !field_is_present<string>(fields, "body")) {
@@ -324,39 +797,208 @@ void process_fwd_message(PurpleConnection* gc, const picojson::value& fields, Me
         return;
     }
 
-    message.text += "<br>";
+    // Lines of the forwarded message are quoted once per nesting level. The header of nested message
+    // starts a new line, quoted as the message it has been forwarded in.
+    string prefix;
+    for (unsigned i = 0; i < depth; i++)
+        prefix += FWD_QUOTE_PREFIX;
+    if (depth == 1) {
+        message.text += "<br>";
+    } else {
+        message.text += "\n";
+        message.text += prefix.substr(sizeof(FWD_QUOTE_PREFIX) - 1);
+    }
 
     uint64 user_id = fields.get("user_id").get<double>();
     string date = timestamp_to_long_format(fields.get("date").get<double>());
-    // Placeholder either contains a formed href, if the user is already known, or will be replaced
-    // with proper name and href in replace_ids().
-    string text = str_format(i18n("Forwarded message (from %s on %s):\n"),
-                             get_user_placeholder(gc, user_id, message).data(), date.data());
-    text += cleanup_message_body(fields.get("body").get<string>());
-    // Prepend quotation marks to all forwared message lines.
-    str_replace(text, "\n", "\n    > ");
+    const FwdHeaderFormat& format = get_fwd_header_format();
 
-    message.text += text;
+    // Quotation marks are prepended while the text is appended, so the cost is linear in the size
+    // of the whole thread regardless of its depth.
+    append_quoted(message.text, format.before_user, prefix);
+    if (format.date_first)
+        append_quoted(message.text, date, prefix);
+    else
+        append_user_placeholder(gc, user_id, message.text, message);
+    append_quoted(message.text, format.between, prefix);
+    if (format.date_first)
+        append_user_placeholder(gc, user_id, message.text, message);
+    else
+        append_quoted(message.text, date, prefix);
+    append_quoted(message.text, format.after_date, prefix);
+    append_quoted(message.text, cleanup_message_body(fields.get("body").get<string>()), prefix);
 
     if (field_is_present<picojson::array>(fields, "attachments"))
         process_attachments(gc, fields.get("attachments").get<picojson::array>(), message);
     if (field_is_present<picojson::object>(fields, "geo"))
         process_geo(fields.get("geo"), message);
+
+    if (field_is_present<picojson::array>(fields, "fwd_messages")) {
+        if (depth >= MAX_FWD_DEPTH) {
+            vkcom_debug_error("Forwarded messages are nested too deep, skipping them\n");
+            return;
+        }
+        const picojson::array& fwd_messages = fields.get("fwd_messages").get<picojson::array>();
+        for (const picojson::value& m: fwd_messages)
+            process_fwd_message(gc, m, message, depth + 1);
+    }
+}
+
+void append_quoted(MessageText& out, const string& text, const string& prefix)
+{
+    size_t start = 0;
+    size_t newline;
+    while ((newline = text.find('\n', start)) != string::npos) {
+        out += text.substr(start, newline + 1 - start);
+        out += prefix;
+        start = newline + 1;
+    }
+    out += text.substr(start);
+}
+
+AttachmentType intern_attachment_type(const string& type)
+{
+    // Compare only with the types starting with the same letter.
+    switch (type.empty() ? '\0' : type[0]) {
+    case 'a':
+        if (type == "audio")
+            return ATTACHMENT_AUDIO;
+        if (type == "album")
+            return ATTACHMENT_ALBUM;
+        break;
+    case 'd':
+        if (type == "doc")
+            return ATTACHMENT_DOC;
+        break;
+    case 'g':
+        if (type == "gift")
+            return ATTACHMENT_GIFT;
+        break;
+    case 'l':
+        if (type == "link")
+            return ATTACHMENT_LINK;
+        break;
+    case 'p':
+        if (type == "photo")
+            return ATTACHMENT_PHOTO;
+        break;
+    case 's':
+        if (type == "sticker")
+            return ATTACHMENT_STICKER;
+        break;
+    case 'v':
+        if (type == "video")
+            return ATTACHMENT_VIDEO;
+        break;
+    case 'w':
+        if (type == "wall")
+            return ATTACHMENT_WALL;
+        break;
+    }
+    return ATTACHMENT_UNKNOWN;
+}
+
+// The table of renderers, indexed by AttachmentType.
+const AttachmentRenderer attachment_renderers[] = {
+    { { { "id", FIELD_NUMBER }, { "owner_id", FIELD_NUMBER }, { "text", FIELD_STRING },
+        { "photo_604", FIELD_STRING } }, process_photo_attachment },
+    { { { "id", FIELD_NUMBER }, { "owner_id", FIELD_NUMBER }, { "title", FIELD_STRING },
+        { "photo_320", FIELD_STRING } }, process_video_attachment },
+    { { { "url", FIELD_STRING }, { "artist", FIELD_STRING }, { "title", FIELD_STRING } },
+      process_audio_attachment },
+    { { { "url", FIELD_STRING }, { "title", FIELD_STRING } }, process_doc_attachment },
+    { { { "id", FIELD_NUMBER }, { "date", FIELD_NUMBER }, { "text", FIELD_STRING } },
+      process_wall_attachment },
+    { { { "url", FIELD_STRING } }, process_link_attachment },
+    { { { "id", FIELD_STRING }, { "owner_id", FIELD_NUMBER }, { "title", FIELD_STRING } },
+      process_album_attachment },
+    { { { "photo_64", FIELD_STRING } }, process_sticker_attachment },
+    { { }, process_gift_attachment },
+};
+static_assert(sizeof(attachment_renderers) / sizeof(attachment_renderers[0]) == ATTACHMENT_UNKNOWN,
+              "Each attachment type must have a renderer");
+
+const ThumbnailVariant photo_thumbnails[] = {
+    { "photo_75", 75 }, { "photo_130", 130 }, { "photo_604", 604 }, { "photo_807", 807 },
+    { "photo_1280", 1280 }, { "photo_2560", 2560 }, { nullptr, 0 }
+};
+const ThumbnailVariant video_thumbnails[] = {
+    { "photo_130", 130 }, { "photo_320", 320 }, { "photo_640", 640 }, { "photo_800", 800 }, { nullptr, 0 }
+};
+
+bool get_required_fields(AttachmentType type, const picojson::value& fields, AttachmentFields& values)
+{
+    if (!fields.is<picojson::object>())
+        return false;
+    const picojson::object& object = fields.get<picojson::object>();
+    const AttachmentRenderer& renderer = attachment_renderers[type];
+    for (size_t i = 0; i < MAX_REQUIRED_FIELDS && renderer.required[i].name; i++) {
+        auto it = object.find(renderer.required[i].name);
+        if (it == object.end())
+            return false;
+        bool ok = renderer.required[i].kind == FIELD_NUMBER ? it->second.is<double>()
+                                                            : it->second.is<string>();
+        if (!ok)
+            return false;
+        values[i] = &it->second;
+    }
+    return true;
 }
 
-void process_photo_attachment(const picojson::value& fields, Message& message,
-                              const VkOptions& options)
+void render_attachment(PurpleConnection* gc, AttachmentType type, const picojson::value& fields,
+                       Message& message, const VkOptions& options)
 {
-    if (!field_is_present<double>(fields, "id") || !field_is_present<double>(fields, "owner_id")
-            || !field_is_present<string>(fields, "text") || !field_is_present<string>(fields, "photo_604")) {
+    AttachmentFields values;
+    if (!get_required_fields(type, fields, values)) {
         vkcom_debug_error("Strange attachment in response from messages.get "
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
     }
-    const uint64 id = fields.get("id").get<double>();
-    const int64 owner_id = fields.get("owner_id").get<double>();
-    const string& photo_text = fields.get("text").get<string>();
-    const string& thumbnail = fields.get("photo_604").get<string>();
+    attachment_renderers[type].render(gc, fields, values, message, options);
+}
+
+void append_link(MessageText& text, const string& url, const string& title)
+{
+    text += "<a href='";
+    text += url;
+    text += "'>";
+    text += title;
+    text += "</a>";
+}
+
+string select_thumbnail(const picojson::value& fields, const ThumbnailVariant* variants, int max_size,
+                        const string& fallback)
+{
+    if (max_size <= 0)
+        return fallback;
+
+    // Variants of a small image are not upscaled, so the variant, which fits by its nominal size,
+    // is never bigger than the box either.
+    const string* smallest = nullptr;
+    const string* fitting = nullptr;
+    for (const ThumbnailVariant* variant = variants; variant->name; variant++) {
+        if (!field_is_present<string>(fields, variant->name))
+            continue;
+        const string& url = fields.get(variant->name).get<string>();
+        if (!smallest)
+            smallest = &url;
+        if (variant->size > max_size)
+            break;
+        fitting = &url;
+    }
+    if (fitting)
+        return *fitting;
+    return smallest ? *smallest : fallback;
+}
+
+void process_photo_attachment(PurpleConnection*, const picojson::value& fields, const AttachmentFields& values,
+                              Message& message, const VkOptions& options)
+{
+    const uint64 id = values[0]->get<double>();
+    const int64 owner_id = values[1]->get<double>();
+    const string& photo_text = values[2]->get<string>();
+    const string& photo_604 = values[3]->get<string>();
+    string thumbnail = select_thumbnail(fields, photo_thumbnails, options.thumbnail_max_size, photo_604);
 
     // Apparently, there is no URL for private photos (such as the one for docs:
     // https://vk.com/docXXX_XXX?hash="access_key". If we've got "access_key" as a parameter, it means
@@ -371,66 +1013,48 @@ void process_photo_attachment(const picojson::value& fields, Message& message,
         else if (field_is_present<string>(fields, "photo_807"))
             url = fields.get("photo_807").get<string>();
         else
-            url = thumbnail;
+            url = photo_604;
     } else {
         url = str_format("https://vk.com/photo%lld_%llu", (long long)owner_id,
                          (unsigned long long)id);
     }
 
-    if (!photo_text.empty())
-        message.text += str_format("<a href='%s'>%s</a>", url.data(), photo_text.data());
-    else
-        message.text += str_format("<a href='%s'>%s</a>", url.data(), url.data());
+    append_link(message.text, url, !photo_text.empty() ? photo_text : url);
     append_thumbnail_placeholder(thumbnail, message, options);
 }
 
-void process_video_attachment(const picojson::value& fields, Message& message,
-                              const VkOptions& options)
+void process_video_attachment(PurpleConnection*, const picojson::value& fields, const AttachmentFields& values,
+                              Message& message, const VkOptions& options)
 {
-    if (!field_is_present<double>(fields, "id") || !field_is_present<double>(fields, "owner_id")
-            || !field_is_present<string>(fields, "title") || !field_is_present<string>(fields, "photo_320")) {
-        vkcom_debug_error("Strange attachment in response from messages.get "
-                           "or messages.getById: %s\n", fields.serialize().data());
-        return;
-    }
-    const uint64 id = fields.get("id").get<double>();
-    const int64 owner_id = fields.get("owner_id").get<double>();
-    const string& title = fields.get("title").get<string>();
-    const string& thumbnail = fields.get("photo_320").get<string>();
+    const uint64 id = values[0]->get<double>();
+    const int64 owner_id = values[1]->get<double>();
+    const string& title = values[2]->get<string>();
+    string thumbnail = select_thumbnail(fields, video_thumbnails, options.thumbnail_max_size,
+                                        values[3]->get<string>());
 
-    message.text += str_format("<a href='https://vk.com/video%lld_%llu'>%s</a>",
-                               (long long)owner_id, (unsigned long long)id, title.data());
+    string url = str_format("https://vk.com/video%lld_%llu", (long long)owner_id, (unsigned long long)id);
+    append_link(message.text, url, title);
 
     append_thumbnail_placeholder(thumbnail, message, options);
 }
 
-void process_audio_attachment(const picojson::value& fields, Message& message)
+void process_audio_attachment(PurpleConnection*, const picojson::value&, const AttachmentFields& values,
+                              Message& message, const VkOptions&)
 {
-    if (!field_is_present<string>(fields, "url") || !field_is_present<string>(fields, "artist")
-            || !field_is_present<string>(fields, "title")) {
-        vkcom_debug_error("Strange attachment in response from messages.get "
-                           "or messages.getById: %s\n", fields.serialize().data());
-        return;
-    }
-    const string& url = fields.get("url").get<string>();
-    const string& artist = fields.get("artist").get<string>();
-    const string& title = fields.get("title").get<string>();
+    const string& url = values[0]->get<string>();
+    const string& artist = values[1]->get<string>();
+    const string& title = values[2]->get<string>();
 
-    message.text += str_format("<a href='%s'>%s - %s</a>", url.data(), artist.data(), title.data());
+    append_link(message.text, url, artist + " - " + title);
 }
 
-void process_doc_attachment(const picojson::value& fields, Message& message,
-                            const VkOptions& options)
+void process_doc_attachment(PurpleConnection*, const picojson::value& fields, const AttachmentFields& values,
+                            Message& message, const VkOptions& options)
 {
-    if (!field_is_present<string>(fields, "url") || !field_is_present<string>(fields, "title")) {
-        vkcom_debug_error("Strange attachment in response from messages.get "
-                           "or messages.getById: %s\n", fields.serialize().data());
-        return;
-    }
-    const string& url = fields.get("url").get<string>();
-    const string& title = fields.get("title").get<string>();
+    const string& url = values[0]->get<string>();
+    const string& title = values[1]->get<string>();
 
-    message.text += str_format("<a href='%s'>%s</a>", url.data(), title.data());
+    append_link(message.text, url, title);
 
     // Check if we've got a thumbnail.
     if (field_is_present<string>(fields, "photo_130")) {
@@ -439,13 +1063,16 @@ void process_doc_attachment(const picojson::value& fields, Message& message,
     }
 }
 
-void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields, Message& message)
+void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields, const AttachmentFields& values,
+                             Message& message, const VkOptions& options)
 {
-    if (!field_is_present<double>(fields, "id")
-            || (!field_is_present<double>(fields, "to_id")
-                && !field_is_present<double>(fields, "from_id"))
-            || !field_is_present<double>(fields, "date")
-            || !field_is_present<string>(fields, "text")) {
+    // This happens in case of reposts, where only "from_id" is specified.
+    int64 to_id;
+    if (field_is_present<double>(fields, "to_id")) {
+        to_id = fields.get("to_id").get<double>();
+    } else if (field_is_present<double>(fields, "from_id")) {
+        to_id = fields.get("from_id").get<double>();
+    } else {
         vkcom_debug_error("Strange attachment in response from messages.get "
                            "or messages.getById: %s\n", fields.serialize().data());
         return;
@@ -453,34 +1080,32 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
 
     message.text += "<br>";
 
-    uint64 id = fields.get("id").get<double>();
-    // This happens in case of reposts, where only "from_id" is specified.
-    int64 to_id;
-    if (field_is_present<double>(fields, "to_id"))
-        to_id = fields.get("to_id").get<double>();
-    else
-        to_id = fields.get("from_id").get<double>();
-
+    uint64 id = values[0]->get<double>();
     if (to_id > 0) {
-        message.text += get_user_placeholder(gc, to_id, message);
+        append_user_placeholder(gc, to_id, message.text, message);
     } else {
-        message.text += get_group_placeholder(gc, -to_id, message);
+        append_group_placeholder(gc, -to_id, message.text, message);
     }
 
     string wall_url = str_format("https://vk.com/wall%lld_%llu", (long long)to_id,
                                  (unsigned long long)id);
     const char* verb = (fields.contains("copy_text") || fields.contains("copy_history"))
                         ? i18n("reposted") : i18n("posted");
-    string date = timestamp_to_long_format(fields.get("date").get<double>());
-
-    message.text += str_format(" <a href='%s'>%s</a> %s %s<br>", wall_url.data(), verb,
-                               i18n("on"), date.data());
+    string date = timestamp_to_long_format(values[1]->get<double>());
+
+    message.text += " ";
+    append_link(message.text, wall_url, verb);
+    message.text += " ";
+    message.text += i18n("on");
+    message.text += " ";
+    message.text += date;
+    message.text += "<br>";
 
     if (field_is_present<string>(fields, "copy_text")) {
         message.text += fields.get("copy_text").get<string>();
         message.text += "<br>";
     }
-    message.text += fields.get("text").get<string>();
+    message.text += values[2]->get<string>();
 
     if (field_is_present<picojson::array>(fields, "attachments"))
         process_attachments(gc, fields.get("attachments").get<picojson::array>(), message);
@@ -491,77 +1116,56 @@ void process_wall_attachment(PurpleConnection* gc, const picojson::value& fields
     if (field_is_present<picojson::array>(fields, "copy_history")) {
         const picojson::array& a = fields.get("copy_history").get<picojson::array>();
         for (const picojson::value& v: a)
-            process_wall_attachment(gc, v, message);
+            render_attachment(gc, ATTACHMENT_WALL, v, message, options);
     }
 }
 
-void process_link_attachment(const picojson::value& fields, Message& message,
-                             const VkOptions& options)
+void process_link_attachment(PurpleConnection*, const picojson::value& fields, const AttachmentFields& values,
+                             Message& message, const VkOptions& options)
 {
-    if (!field_is_present<string>(fields, "url")) {
-        vkcom_debug_error("Strange attachment in response from messages.get "
-                           "or messages.getById: %s\n", fields.serialize().data());
-        return;
-    }
-    const string& url = fields.get("url").get<string>();
+    const string& url = values[0]->get<string>();
 
     // link attachment is not described anywhere in Vk.com documentation, so we cannot be sure,
     // which fields are required and which are optional. Let's treat all of them apart from url
     // as optional.
-    string title;
-    if (field_is_present<string>(fields, "title"))
-        title = fields.get("title").get<string>();
-    string description;
-    if (field_is_present<string>(fields, "description"))
-        description = fields.get("description").get<string>();
-    string image_src;
-    if (field_is_present<string>(fields, "image_src"))
-        image_src = fields.get("image_src").get<string>();
-
-    if (!title.empty())
-        message.text += str_format("<a href='%s'>%s</a>", url.data(), title.data());
+    if (field_is_present<string>(fields, "title") && !fields.get("title").get<string>().empty())
+        append_link(message.text, url, fields.get("title").get<string>());
     else
-        message.text += url.data();
+        message.text += url;
 
-    if (!description.empty()) {
+    if (field_is_present<string>(fields, "description")
+            && !fields.get("description").get<string>().empty()) {
         message.text += "<br>";
-        message.text += description;
+        message.text += fields.get("description").get<string>();
     }
 
-    if (!image_src.empty())
-        append_thumbnail_placeholder(image_src, message, options);
+    if (field_is_present<string>(fields, "image_src") && !fields.get("image_src").get<string>().empty())
+        append_thumbnail_placeholder(fields.get("image_src").get<string>(), message, options);
 }
 
-void process_album_attachment(const picojson::value& fields, Message& message)
+void process_album_attachment(PurpleConnection*, const picojson::value&, const AttachmentFields& values,
+                              Message& message, const VkOptions&)
 {
-    if (!field_is_present<string>(fields, "id") || !field_is_present<double>(fields, "owner_id")
-            || !field_is_present<string>(fields, "title")) {
-        vkcom_debug_error("Strange attachment in response from messages.get "
-                           "or messages.getById: %s\n", fields.serialize().data());
-        return;
-    }
-    const string& id = fields.get("id").get<string>();
-    string owner_id = fields.get("owner_id").to_str();
-    const string& title = fields.get("title").get<string>();
+    const string& id = values[0]->get<string>();
+    string owner_id = values[1]->to_str();
+    const string& title = values[2]->get<string>();
 
     string url = str_format("https://vk.com/album%s_%s", owner_id.data(), id.data());
-    message.text += str_format("%s: <a href='%s'>%s</a>", i18n("Album"), url.data(), title.data());
+    message.text += i18n("Album");
+    message.text += ": ";
+    append_link(message.text, url, title);
 }
 
-void process_sticker_attachment(const picojson::value& fields, Message& message,
-                                const VkOptions& options)
+void process_sticker_attachment(PurpleConnection*, const picojson::value&, const AttachmentFields& values,
+                                Message& message, const VkOptions& options)
 {
-    if (!field_is_present<string>(fields, "photo_64")) {
-        vkcom_debug_error("Strange attachment in response from messages.get "
-                           "or messages.getById: %s\n", fields.serialize().data());
-        return;
-    }
-    const string& thumbnail = fields.get("photo_64").get<string>();
+    const string& thumbnail = values[0]->get<string>();
 
     append_thumbnail_placeholder(thumbnail, message, options, false);
 }
 
-void process_gift_attachment(const picojson::value& fields, Message& message, const VkOptions& options)
+void process_gift_attachment(PurpleConnection*, const picojson::value& fields, const AttachmentFields&,
+                             Message& message, const VkOptions& options)
 {
     string thumbnail;
     if (field_is_present<string>(fields, "thumb_256"))
@@ -579,7 +1183,6 @@ void process_gift_attachment(const picojson::value& fields, Message& message, co
     append_thumbnail_placeholder(thumbnail, message, options, false);
 }
 
-
 void process_geo(const picojson::value& fields, Message& message)
 {
     if (!field_is_present<string>(fields, "coordinates")) {
@@ -648,7 +1251,7 @@ void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
     // TODO: If the conversation is open and an outgoing message has been received, we should show
     // the image too.
     if (message.status == MESSAGE_INCOMING_UNREAD) {
-        // We will download the image later and replace the placeholder.
+        // We will download the image later.
         if (!message.text.empty() || prepend_br)
             message.text += "<br>";
         if (options.enable_webkit_workarounds) {
@@ -656,104 +1259,295 @@ void append_thumbnail_placeholder(const string& thumbnail_url, Message& message,
             // at all and append <img src=> instead.
             message.text += str_format("<img src=\"%s\" width=\"100%%\">", thumbnail_url.data());
         } else {
-            message.text += str_format("<thumbnail-placeholder-%zu>", message.thumbnail_urls.size());
+            message.text.append_hole(MessageText::THUMBNAIL, message.thumbnail_urls.size());
             message.thumbnail_urls.push_back(thumbnail_url);
+            message.thumbnail_img_ids.push_back(0);
         }
     }
 }
 
-string get_user_placeholder(PurpleConnection* gc, uint64 user_id, Message& message)
+void append_user_placeholder(PurpleConnection* gc, uint64 user_id, MessageText& text, Message& message)
 {
     if (user_id == 0)
-        return "";
+        return;
 
-    VkUserInfo* info = get_user_info(gc, user_id);
+    text.append_hole(MessageText::USER, user_id);
     // We can have user_info, but the user can be unknown.
-    if (info && !is_unknown_user(gc, user_id)) {
-        return get_user_href(user_id, *info);
-    } else {
-        // We will get user information later and replace the placeholder.
-        string text = str_format("<user-placeholder-%zu>", message.unknown_user_ids.size());
+    if (!get_user_info(gc, user_id) || is_unknown_user(gc, user_id))
         message.unknown_user_ids.push_back(user_id);
-        return text;
-    }
 }
 
-string get_group_placeholder(PurpleConnection* gc, uint64 group_id, Message& message)
+void append_group_placeholder(PurpleConnection* gc, uint64 group_id, MessageText& text, Message& message)
 {
     if (group_id == 0)
-        return "";
+        return;
 
-    VkGroupInfo* info = get_group_info(gc, group_id);
+    text.append_hole(MessageText::GROUP, group_id);
     // We can have group_info, but the group can be unknown.
-    if (info && !is_unknown_group(gc, group_id)) {
-        return get_group_href(group_id, *info);
-    } else {
-        // We will get group information later and replace the placeholder.
-        string text = str_format("<group-placeholder-%zu>", message.unknown_group_ids.size());
+    if (!get_group_info(gc, group_id) || is_unknown_group(gc, group_id))
         message.unknown_group_ids.push_back(group_id);
-        return text;
+}
+
+string render_message_text(PurpleConnection* gc, const Message& message, bool inline_thumbnails)
+{
+    return message.text.render([&](MessageText::HoleType type, uint64 id) -> string {
+        switch (type) {
+        case MessageText::THUMBNAIL: {
+            const string& url = message.thumbnail_urls[id];
+            int img_id = message.thumbnail_img_ids[id];
+            // Failed and late downloads and the images, which have already been released, are shown
+            // as links.
+            if (img_id == 0 || !inline_thumbnails || !get_thumbnail_images(gc).is_held(img_id))
+                return str_format("<a href=\"%s\">%s</a>", url.data(), url.data());
+            return str_format("<img id=\"%d\">", img_id);
+        }
+        case MessageText::USER: {
+            // Getting the user info could fail.
+            VkUserInfo* info = get_user_info(gc, id);
+            if (!info)
+                return str_format("<a href='https://vk.com/id%llu'>id%llu</a>", (unsigned long long)id,
+                                  (unsigned long long)id);
+            return get_user_href(gc, id, *info);
+        }
+        case MessageText::GROUP: {
+            // Getting the group info could fail.
+            VkGroupInfo* info = get_group_info(gc, id);
+            if (!info)
+                return str_format("<a href='https://vk.com/club%llu'>club%llu</a>", (unsigned long long)id,
+                                  (unsigned long long)id);
+            return get_group_href(id, *info);
+        }
+        }
+        return "";
+    });
+}
+
+StoredMessage make_stored_message(PurpleConnection* gc, const Message& message, const string& text)
+{
+    StoredMessage stored;
+    stored.msg_id = message.mid;
+    stored.peer_id = peer_id_from_ids(message.user_id, message.chat_id);
+    stored.outgoing = message.status == MESSAGE_OUTGOING;
+    stored.timestamp = message.timestamp;
+    stored.from = get_author_display_name(gc, message);
+    // imgstore ids are valid only during this session.
+    if (message.thumbnail_urls.empty())
+        stored.text = text;
+    else
+        stored.text = render_message_text(gc, message, false);
+    return stored;
+}
+
+string get_author_display_name(PurpleConnection* gc, const Message& message)
+{
+    if (message.status == MESSAGE_OUTGOING) {
+        if (message.chat_id != 0)
+            return get_self_chat_display_name(gc);
+        else
+            return purple_account_get_name_for_display(purple_connection_get_account(gc));
+    } else {
+        if (message.chat_id != 0)
+            return get_user_display_name(gc, message.user_id, message.chat_id);
+        else
+            return get_user_display_name(gc, message.user_id);
     }
 }
 
-void download_thumbnail(const MessagesData_ptr& data, size_t msg_num, size_t thumb_num)
+// One thumbnail to download: indices into messages and Message::thumbnail_urls.
+struct ThumbnailTask
 {
-    if (msg_num >= data->messages.size()) {
-        replace_user_ids(data);
-        return;
+    size_t msg_num;
+    size_t thumb_num;
+};
+
+// State of thumbnail downloads for one MessagesData.
+struct ThumbnailDownloads
+{
+    // Reset after all downloads have finished.
+    MessagesData_ptr data;
+    // Downloads, which have not been started yet, and the number of running downloads per host.
+    map<string, deque<ThumbnailTask>> queued;
+    map<string, unsigned> running;
+    // Set while start_thumbnail_downloads is running. Cached thumbnails are returned immediately,
+    // so we must not start next downloads from the callback recursively.
+    bool starting;
+    // The number of thumbnails, which have not been downloaded and added to imgstore yet.
+    size_t remaining;
+    // Set when all downloads have finished or the deadline has passed.
+    bool finished;
+};
+typedef shared_ptr<ThumbnailDownloads> ThumbnailDownloads_ptr;
+
+// Starts queued downloads for host until the limit of running downloads is reached.
+void start_thumbnail_downloads(const ThumbnailDownloads_ptr& downloads, const string& host);
+// Called when the thumbnail has either been added to imgstore or failed to download.
+void finish_thumbnail(const ThumbnailDownloads_ptr& downloads);
+// Stops waiting for running downloads and finishes the stage.
+void finish_thumbnail_downloads(const ThumbnailDownloads_ptr& downloads);
+
+string get_url_host(const string& url)
+{
+    PurpleHttpURL* parsed_url = purple_http_url_parse(url.data());
+    if (!parsed_url)
+        return "";
+    const char* host = purple_http_url_get_host(parsed_url);
+    string ret = host ? host : "";
+    purple_http_url_free(parsed_url);
+    return ret;
+}
+
+void receive_message_infos(const MessagesData_ptr& data)
+{
+    // Stages may finish immediately, so the counter is set before any of them starts.
+    // Downloading thumbnails for old messages would take more time and traffic than it is worth,
+    // they are written as links.
+    data->stages_running = data->history ? 3 : 4;
+    if (!data->history)
+        download_thumbnails(data);
+    replace_user_ids(data);
+    replace_group_ids(data);
+    add_unknown_chats(data);
+}
+
+void finish_stage(const MessagesData_ptr& data)
+{
+    data->stages_running--;
+    if (data->stages_running == 0)
+        finish_receiving(data);
+}
+
+void download_thumbnails(const MessagesData_ptr& data)
+{
+    ThumbnailDownloads_ptr downloads{ new ThumbnailDownloads() };
+    downloads->data = data;
+    downloads->remaining = 0;
+    downloads->finished = false;
+    downloads->starting = false;
+    for (size_t msg_num = 0; msg_num < data->messages.size(); msg_num++) {
+        const vector<string>& urls = data->messages[msg_num].thumbnail_urls;
+        for (size_t thumb_num = 0; thumb_num < urls.size(); thumb_num++) {
+            downloads->queued[get_url_host(urls[thumb_num])].push_back({ msg_num, thumb_num });
+            downloads->remaining++;
+        }
     }
-    if (thumb_num >= data->messages[msg_num].thumbnail_urls.size()) {
-        download_thumbnail(data, msg_num + 1, 0);
+
+    if (downloads->remaining == 0) {
+        finish_stage(data);
         return;
     }
 
-    const string& url = data->messages[msg_num].thumbnail_urls[thumb_num];
-    http_get(data->gc, url, [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
-        if (!purple_http_response_is_successful(response)) {
-            vkcom_debug_error("Unable to download thumbnail: %s\n",
-                               purple_http_response_get_error(response));
-            download_thumbnail(data, msg_num, thumb_num + 1);
-            return;
+    vkcom_debug_info("Downloading %zu thumbnails from %zu hosts\n", downloads->remaining,
+                     downloads->queued.size());
+    timeout_add(data->gc, THUMBNAIL_DOWNLOADS_DEADLINE, [=] {
+        if (!downloads->finished) {
+            vkcom_debug_error("%zu thumbnails have not been downloaded in time\n", downloads->remaining);
+            finish_thumbnail_downloads(downloads);
         }
+        return false;
+    });
+
+    // finish_thumbnail_downloads may clear queued if all thumbnails are in the cache.
+    vector<string> hosts;
+    for (const auto& it: downloads->queued)
+        hosts.push_back(it.first);
+    for (const string& host: hosts)
+        start_thumbnail_downloads(downloads, host);
+}
 
-        size_t size;
-        const char* img_data = purple_http_response_get_data(response, &size);
-        int img_id = purple_imgstore_add_with_id(g_memdup(img_data, size), size, nullptr);
+void start_thumbnail_downloads(const ThumbnailDownloads_ptr& downloads, const string& host)
+{
+    PurpleConnection* gc = downloads->data->gc;
+    unsigned limit = std::max(get_data(gc).options().thumbnail_downloads_per_host, 1);
+    int max_size = get_data(gc).options().thumbnail_max_size;
+    deque<ThumbnailTask>& queue = downloads->queued[host];
+    unsigned& running = downloads->running[host];
+    downloads->starting = true;
+    while (!downloads->finished && !queue.empty() && running < limit) {
+        ThumbnailTask task = queue.front();
+        queue.pop_front();
+
+        Message& message = downloads->data->messages[task.msg_num];
+        const string& url = message.thumbnail_urls[task.thumb_num];
+        uint64 peer_id = peer_id_from_ids(message.user_id, message.chat_id);
+        // The same thumbnail (e.g. a sticker) may still be held from an earlier message.
+        int held_img_id = get_thumbnail_images(gc).find(url, peer_id);
+        if (held_img_id != 0) {
+            message.thumbnail_img_ids[task.thumb_num] = held_img_id;
+            finish_thumbnail(downloads);
+            continue;
+        }
 
-        string img_tag = str_format("<img id=\"%d\">", img_id);
-        string img_placeholder = str_format("<thumbnail-placeholder-%zu>", thumb_num);
-        str_replace(data->messages[msg_num].text, img_placeholder, img_tag);
+        running++;
+        http_get_cached(gc, url, [=](const char* img_data, size_t size) {
+            // The deadline has passed, the thumbnail will be shown as link.
+            if (downloads->finished)
+                return;
+            downloads->running[host]--;
+
+            if (img_data) {
+                // Thumbnails are decoded and scaled on a worker thread, the next download starts
+                // in the meantime.
+                scale_image_async(gc, img_data, size, max_size, [=](const char* scaled, size_t scaled_size) {
+                    if (downloads->finished)
+                        return;
+                    int img_id = get_thumbnail_images(gc).add(url, peer_id, scaled, scaled_size);
+                    downloads->data->messages[task.msg_num].thumbnail_img_ids[task.thumb_num] = img_id;
+                    finish_thumbnail(downloads);
+                });
+            } else {
+                finish_thumbnail(downloads);
+            }
 
-        download_thumbnail(data, msg_num, thumb_num + 1);
-    });
+            if (!downloads->finished && !downloads->starting)
+                start_thumbnail_downloads(downloads, host);
+        });
+    }
+    downloads->starting = false;
+}
+
+void finish_thumbnail(const ThumbnailDownloads_ptr& downloads)
+{
+    downloads->remaining--;
+    if (downloads->remaining == 0)
+        finish_thumbnail_downloads(downloads);
+}
+
+void finish_thumbnail_downloads(const ThumbnailDownloads_ptr& downloads)
+{
+    // Downloads, which are still running, are not cancelled: they will be stored in the cache
+    // and shown next time.
+    downloads->finished = true;
+    MessagesData_ptr data = downloads->data;
+    downloads->data.reset();
+    downloads->queued.clear();
+    finish_stage(data);
 }
 
 void replace_user_ids(const MessagesData_ptr& data)
 {
-    // Get all user ids, which are not present in user_infos.
+    // Get all user ids, which are not present in user_infos. Some of the authors may be received
+    // along with chat infos in add_unknown_chats, but requesting them here does not make
+    // the messages wait for the chat infos.
     set<uint64> unknown_user_ids;
     for (const Message& message: data->messages) {
         insert_if(unknown_user_ids, message.unknown_user_ids, [=](uint64 user_id) {
             return is_unknown_user(data->gc, user_id);
         });
+        if (message.status != MESSAGE_OUTGOING && is_unknown_user(data->gc, message.user_id))
+            unknown_user_ids.insert(message.user_id);
     }
 
     update_user_infos(data->gc, unknown_user_ids, [=] {
-        for (Message& m: data->messages) {
-            for (size_t i = 0; i < m.unknown_user_ids.size(); i++) {
-                uint64 id = m.unknown_user_ids[i];
-                VkUserInfo* info = get_user_info(data->gc, id);
-                // Getting the user info could fail.
-                if (!info)
-                    continue;
-
-                string placeholder = str_format("<user-placeholder-%zu>", i);
-                string href = get_user_href(id, *info);
-                str_replace(m.text, placeholder, href);
-            }
-        }
+        // Users to be added to buddy list: authors of unread non-chat messages. Chat participants
+        // are never added to buddy list (unless they are already there).
+        set<uint64> user_ids_to_buddy_list;
+        for (const Message& m: data->messages)
+            if (m.status == MESSAGE_INCOMING_UNREAD && m.chat_id == 0 && !user_in_buddy_list(data->gc, m.user_id))
+                user_ids_to_buddy_list.insert(m.user_id);
 
-        replace_group_ids(data);
+        add_buddies_if_needed(data->gc, user_ids_to_buddy_list, [=] {
+            finish_stage(data);
+        });
     });
 }
 
@@ -767,25 +1561,11 @@ void replace_group_ids(const MessagesData_ptr& data)
     }
 
     update_groups_info(data->gc, group_ids, [=] {
-        for (Message& m: data->messages) {
-            for (size_t i = 0; i < m.unknown_group_ids.size(); i++) {
-                uint64 group_id = m.unknown_group_ids[i];
-                VkGroupInfo* info = get_group_info(data->gc, group_id);
-                // Getting the group info could fail.
-                if (!info)
-                    continue;
-
-                string placeholder = str_format("<group-placeholder-%zu>", i);
-                string href = get_group_href(group_id, *info);
-                str_replace(m.text, placeholder, href);
-            }
-        }
-
-        add_unknown_users_chats(data);
+        finish_stage(data);
     });
 }
 
-void add_unknown_users_chats(const MessagesData_ptr& data)
+void add_unknown_chats(const MessagesData_ptr& data)
 {
     // Chats to get information about: all incoming chats. Chat participants are updated
     // when updating chat information.
@@ -802,98 +1582,81 @@ void add_unknown_users_chats(const MessagesData_ptr& data)
                 chat_ids_to_buddy_list.insert(m.chat_id);
 
         add_chats_if_needed(data->gc, chat_ids_to_buddy_list, [=] {
-            // Users to get information about: authors of every read incoming message (we need their real
-            // names when we write to the log) and all the users to be added to the buddy list (see below).
-            // Not all chat participants have been updated when chat information was updated due to chats
-            // being deactivated, so let's update info for them.
-            set<uint64> unknown_user_ids;
-            for (const Message& m: data->messages)
-                if (m.status != MESSAGE_OUTGOING && is_unknown_user(data->gc, m.user_id))
-                    unknown_user_ids.insert(m.user_id);
-
-            update_user_infos(data->gc, unknown_user_ids, [=] {
-                // Users to be added to buddy list: authors of unread non-chat messages. Chat participants
-                // are never added to buddy list (unless they are already there).
-                set<uint64> user_ids_to_buddy_list;
-                for (const Message& m: data->messages)
-                    if (m.status == MESSAGE_INCOMING_UNREAD && m.chat_id == 0 && !user_in_buddy_list(data->gc, m.user_id))
-                        user_ids_to_buddy_list.insert(m.user_id);
-
-                add_buddies_if_needed(data->gc, user_ids_to_buddy_list, [=] {
-                    finish_receiving(data);
-                });
-            });
+            finish_stage(data);
         });
     });
 }
 
-void finish_receiving(const MessagesData_ptr& data)
+void merge_message_runs(vector<Message>& messages)
 {
-    std::sort(data->messages.begin(), data->messages.end(), [](const Message& a, const Message& b) {
-        return a.mid < b.mid;
-    });
+    // Find ascending runs, each run is a half-open range of indices.
+    vector<pair<size_t, size_t>> runs;
+    bool has_duplicates = false;
+    size_t run_start = 0;
+    for (size_t i = 1; i <= messages.size(); i++) {
+        if (i == messages.size() || messages[i].mid < messages[i - 1].mid) {
+            runs.emplace_back(run_start, i);
+            run_start = i;
+        } else if (messages[i].mid == messages[i - 1].mid) {
+            has_duplicates = true;
+        }
+    }
+
+    if (runs.size() <= 1) {
+        if (has_duplicates)
+            unique(messages, [](const Message& a, const Message& b) {
+                return a.mid == b.mid;
+            });
+        return;
+    }
+
+    // Merge the runs, keeping the heads of the runs in a min-heap.
+    auto head_greater = [&](const pair<size_t, size_t>& a, const pair<size_t, size_t>& b) {
+        return messages[a.first].mid > messages[b.first].mid;
+    };
+    std::make_heap(runs.begin(), runs.end(), head_greater);
+
+    vector<Message> merged;
+    merged.reserve(messages.size());
+    while (!runs.empty()) {
+        std::pop_heap(runs.begin(), runs.end(), head_greater);
+        pair<size_t, size_t>& run = runs.back();
+        Message& message = messages[run.first];
+        if (merged.empty() || merged.back().mid != message.mid)
+            merged.push_back(std::move(message));
+
+        run.first++;
+        if (run.first == run.second)
+            runs.pop_back();
+        else
+            std::push_heap(runs.begin(), runs.end(), head_greater);
+    }
+    messages = std::move(merged);
+}
 
+void finish_receiving(const MessagesData_ptr& data)
+{
     // We could've received duplicate messages if a new message arrived between asking for
     // two message batches (with two different offsets). In this case batches overlap (offset
     // starts counting from other base).
-    unique(data->messages, [](const Message& a, const Message& b) {
-        return a.mid == b.mid;
-    });
+    merge_message_runs(data->messages);
 
-    PurpleLogCache logs(data->gc);
+    time_t log_time = 0;
+    if (data->history && !data->messages.empty())
+        log_time = data->messages.front().timestamp;
     for (const Message& m: data->messages) {
-        if (m.status == MESSAGE_INCOMING_UNREAD) {
-            // Open new conversation for received message.
-            if (m.chat_id == 0) {
-                string from = user_name_from_id(m.user_id);
-                serv_got_im(data->gc, from.data(), m.text.data(), PURPLE_MESSAGE_RECV, m.timestamp);
-            } else {
-                // Ideally, the chat info would be already added, so the lambda will be called in the current
-                // context.
-                open_chat_conv(data->gc, m.chat_id, [=] {
-                    int conv_id = chat_id_to_conv_id(data->gc, m.chat_id);
-                    string from = get_user_display_name(data->gc, m.user_id, m.chat_id);
-                    serv_got_chat_in(data->gc, conv_id, from.data(), PURPLE_MESSAGE_RECV, m.text.data(),
-                                     m.timestamp);
-                });
-            }
-        } else { // m.status == MESSAGE_INCOMING_READ || m.status == MESSAGE_OUTGOING
-            // Check if the conversation is open, so that we write to the conversation, not the log.
-            // TODO: Remove code duplication with vk-longpoll.cpp
-            string from;
-            PurpleMessageFlags flags;
-            if (m.status == MESSAGE_INCOMING_READ) {
-                if (m.chat_id != 0)
-                    from = get_user_display_name(data->gc, m.user_id, m.chat_id);
-                else
-                    from = get_user_display_name(data->gc, m.user_id);
-                flags = PURPLE_MESSAGE_RECV;
-            } else {
-                if (m.chat_id != 0)
-                    from = get_self_chat_display_name(data->gc);
-                else
-                    from = purple_account_get_name_for_display(purple_connection_get_account(data->gc));
-                flags = PURPLE_MESSAGE_SEND;
-            }
-
-            PurpleConversation* conv = find_conv_for_id(data->gc, m.user_id, m.chat_id);
-            if (conv) {
-                if (m.chat_id == 0)
-                    // It is possible to use real name as the second parameter instead of username
-                    // in the form of "idXXX".
-                    purple_conv_im_write(PURPLE_CONV_IM(conv), from.data(), m.text.data(), flags,
-                                         m.timestamp);
-                else
-                    purple_conv_chat_write(PURPLE_CONV_CHAT(conv), from.data(), m.text.data(), flags,
-                                           m.timestamp);
-            } else {
-                PurpleLog* log;
-                if (m.chat_id == 0)
-                    log = logs.for_user(m.user_id);
-                else
-                    log = logs.for_chat(m.chat_id);
-                purple_log_write(log, flags, from.data(), m.timestamp, m.text.data());
-            }
+        string text = render_message_text(data->gc, m);
+        StoredMessage stored = make_stored_message(data->gc, m, text);
+        if (data->history) {
+            write_received_message(data->gc, m.status, m.user_id, m.chat_id, text, stored, true, log_time);
+        } else {
+            PurpleConnection* gc = data->gc;
+            MessageStatus status = m.status;
+            uint64 user_id = m.user_id;
+            uint64 chat_id = m.chat_id;
+            get_message_sequencer(gc).deliver(stored.peer_id, m.mid, [=] {
+                write_received_message(gc, status, user_id, chat_id, text, stored, false, 0);
+            });
         }
     }
 
@@ -913,10 +1676,98 @@ void finish_receiving(const MessagesData_ptr& data)
         data->received_cb(max_msg_id);
 }
 
+void write_received_message(PurpleConnection* gc, MessageStatus status, uint64 user_id, uint64 chat_id,
+                            const string& text, const StoredMessage& stored, bool history, time_t log_time)
+{
+    // Messages are stored after they have been written, so that the recent messages, shown
+    // in a conversation which is opened for this message, do not include it.
+    if (status == MESSAGE_INCOMING_UNREAD) {
+        // Open new conversation for received message.
+        if (chat_id == 0) {
+            string from = user_name_from_id(user_id);
+            if (!dropped_in_replay(gc, "serv_got_im"))
+                serv_got_im(gc, from.data(), text.data(), PURPLE_MESSAGE_RECV, stored.timestamp);
+            get_message_store(gc).append(stored);
+        } else {
+            // Ideally, the chat info would be already added, so the lambda will be called in the current
+            // context.
+            open_chat_conv(gc, chat_id, [=] {
+                int conv_id = chat_id_to_conv_id(gc, chat_id);
+                // Chat info could have been updated while opening the chat.
+                StoredMessage current = stored;
+                current.from = get_user_display_name(gc, user_id, chat_id);
+                if (!dropped_in_replay(gc, "serv_got_chat_in"))
+                    serv_got_chat_in(gc, conv_id, current.from.data(), PURPLE_MESSAGE_RECV, text.data(),
+                                     current.timestamp);
+                get_message_store(gc).append(current);
+            });
+        }
+    } else { // status == MESSAGE_INCOMING_READ || status == MESSAGE_OUTGOING
+        // Check if the conversation is open, so that we write to the conversation, not the log.
+        // TODO: Remove code duplication with vk-longpoll.cpp
+        const string& from = stored.from;
+        PurpleMessageFlags flags;
+        if (status == MESSAGE_INCOMING_READ)
+            flags = PURPLE_MESSAGE_RECV;
+        else
+            flags = PURPLE_MESSAGE_SEND;
+
+        // Older history must not be mixed with the current messages in the open conversation.
+        PurpleConversation* conv = nullptr;
+        if (!history)
+            conv = find_conv_for_id(gc, user_id, chat_id);
+        if (conv) {
+            if (!dropped_in_replay(gc, "purple_conv_write")) {
+                if (chat_id == 0)
+                    // It is possible to use real name as the second parameter instead of username
+                    // in the form of "idXXX".
+                    purple_conv_im_write(PURPLE_CONV_IM(conv), from.data(), text.data(), flags,
+                                         stored.timestamp);
+                else
+                    purple_conv_chat_write(PURPLE_CONV_CHAT(conv), from.data(), text.data(), flags,
+                                           stored.timestamp);
+            }
+        } else {
+            if (chat_id == 0)
+                get_log_writer(gc).write(user_id, 0, flags, from, stored.timestamp, text, log_time);
+            else
+                get_log_writer(gc).write(0, chat_id, flags, from, stored.timestamp, text, log_time);
+        }
+        get_message_store(gc).append(stored);
+    }
+}
+
 } // End of anonymous namespace
 
+void show_recent_messages(PurpleConnection* gc, PurpleConversation* conv)
+{
+    int count = get_data(gc).options().recent_messages_on_open;
+    if (count <= 0)
+        return;
+
+    PurpleConversationType type = purple_conversation_get_type(conv);
+    uint64 peer_id = peer_id_from_conv(conv);
+    if (peer_id == 0)
+        return;
+
+    // These messages have already been logged.
+    for (const StoredMessage& m: get_message_store(gc).get_latest(peer_id, count)) {
+        PurpleMessageFlags flags = PurpleMessageFlags((m.outgoing ? PURPLE_MESSAGE_SEND : PURPLE_MESSAGE_RECV)
+                                                      | PURPLE_MESSAGE_NO_LOG | PURPLE_MESSAGE_DELAYED);
+        if (type == PURPLE_CONV_TYPE_IM)
+            purple_conv_im_write(PURPLE_CONV_IM(conv), m.from.data(), m.text.data(), flags, m.timestamp);
+        else
+            purple_conv_chat_write(PURPLE_CONV_CHAT(conv), m.from.data(), m.text.data(), flags, m.timestamp);
+    }
+}
+
 namespace {
 
+// Messages, marked as read during this time, are coalesced into one call (in msec).
+const unsigned MARK_AS_READ_DELAY = 500;
+// The maximum number of message ids, passed to messages.markAsRead.
+const size_t MARK_AS_READ_MAX_IDS = 100;
+
 // Returns true if the user is away from the notifications point of view: he is Away and
 // mark_as_read_online_only option is enabled (the default).
 bool is_away(PurpleConnection* gc)
@@ -958,26 +1809,79 @@ void find_active_ids(PurpleConversation* conv, uint64* user_id, uint64* chat_id)
         vkcom_debug_info("Unknown conversation open: %s\n", name);
 }
 
-// Returns true if message belongs to the active conversation, which is defined by active_user_id
-// and active_chat_id, returned from find_active_ids.
-bool message_in_active(const VkReceivedMessage& msg, uint64 active_user_id, uint64 active_chat_id)
+// Returns peer id of the active conversation or zero if no conversation of this account is active.
+uint64 find_active_peer_id(PurpleConnection* gc)
 {
-    if (active_chat_id != 0 && msg.chat_id == active_chat_id)
-        return true;
-    if (active_user_id != 0 && msg.user_id == active_user_id && msg.chat_id == 0)
-        return true;
-    return false;
+    uint64 active_user_id;
+    uint64 active_chat_id;
+    find_active_ids(find_active_conv(gc), &active_user_id, &active_chat_id);
+    return peer_id_from_ids(active_user_id, active_chat_id);
+}
+
+// Moves deferred messages of the active conversation to pending_mark_as_read.
+void take_active_deferred_messages(PurpleConnection* gc)
+{
+    uint64 peer_id = find_active_peer_id(gc);
+    if (peer_id == 0)
+        return;
+
+    VkData& gc_data = get_data(gc);
+    auto it = gc_data.deferred_mark_as_read.find(peer_id);
+    if (it == gc_data.deferred_mark_as_read.end())
+        return;
+    append(gc_data.pending_mark_as_read[peer_id], it->second);
+    gc_data.deferred_mark_as_read.erase(it);
 }
 
-template<typename Cont>
-void mark_messages_as_read_impl(PurpleConnection* gc, const Cont& message_ids)
+// Marks all pending messages as read, no more than MARK_AS_READ_MAX_IDS per call. Messages, which
+// are no longer unread, are skipped.
+void send_pending_mark_as_read(PurpleConnection* gc)
 {
+    VkData& gc_data = get_data(gc);
+    vector<uint64> message_ids;
+    for (const pair<const uint64, vector<uint64>>& p: gc_data.pending_mark_as_read) {
+        auto it = gc_data.unread_messages.find(p.first);
+        if (it == gc_data.unread_messages.end())
+            continue;
+        set<uint64>& unread = it->second;
+        for (uint64 msg_id: p.second)
+            if (unread.erase(msg_id) != 0)
+                message_ids.push_back(msg_id);
+        if (unread.empty())
+            gc_data.unread_messages.erase(it);
+    }
+    gc_data.pending_mark_as_read.clear();
     if (message_ids.empty())
         return;
 
     vkcom_debug_info("Marking %d messages as read\n", (int)message_ids.size());
-    CallParams params = { {"message_ids", str_concat_int(',', message_ids)} };
-    vk_call_api(gc, "messages.markAsRead", params, nullptr, nullptr);
+    for (size_t start = 0; start < message_ids.size(); start += MARK_AS_READ_MAX_IDS) {
+        size_t end = std::min(start + MARK_AS_READ_MAX_IDS, message_ids.size());
+        vector<uint64> call_ids(message_ids.begin() + start, message_ids.begin() + end);
+        CallParams params = { {"message_ids", str_concat_int(',', call_ids)} };
+        vk_call_api(gc, "messages.markAsRead", params, nullptr, nullptr);
+    }
+}
+
+// Marks pending messages as read after MARK_AS_READ_DELAY. Messages, which are received or
+// activated during this time, are marked with the same call.
+void schedule_mark_as_read(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (gc_data.mark_as_read_timer_running)
+        return;
+    gc_data.mark_as_read_timer_running = true;
+
+    timeout_add(gc, MARK_AS_READ_DELAY, [=] {
+        VkData& current = get_data(gc);
+        current.mark_as_read_timer_running = false;
+        // Messages in the active conversation are marked as read, unless the user is away
+        // (see mark_message_as_read).
+        if (!is_away(gc) && !current.options().mark_as_read_replying_only)
+            take_active_deferred_messages(gc);
+        send_pending_mark_as_read(gc);
+        return false;
+    });
 }
 
 } // namespace
@@ -985,26 +1889,16 @@ void mark_messages_as_read_impl(PurpleConnection* gc, const Cont& message_ids)
 void mark_message_as_read(PurpleConnection* gc, const vector<VkReceivedMessage>& messages)
 {
     VkData& gc_data = get_data(gc);
-
-    // Check if we should defer all messages, because we are Away or mark as read only on user action.
-    if (is_away(gc) || gc_data.options().mark_as_read_replying_only) {
-        append(gc_data.deferred_mark_as_read, messages);
-        return;
-    }
-
-    vector<uint64> message_ids;
-    PurpleConversation* conv = find_active_conv(gc);
-    uint64 active_user_id;
-    uint64 active_chat_id;
-    find_active_ids(conv, &active_user_id, &active_chat_id);
     for (const VkReceivedMessage& msg: messages) {
-        if (message_in_active(msg, active_user_id, active_chat_id))
-            message_ids.push_back(msg.msg_id);
-        else
-            gc_data.deferred_mark_as_read.push_back(msg);
+        uint64 peer_id = peer_id_from_ids(msg.user_id, msg.chat_id);
+        gc_data.deferred_mark_as_read[peer_id].push_back(msg.msg_id);
+        gc_data.unread_messages[peer_id].insert(msg.msg_id);
     }
 
-    mark_messages_as_read_impl(gc, message_ids);
+    // Messages stay deferred if we are Away or mark as read only on user action. Otherwise,
+    // the messages in the active conversation are taken when the timer fires.
+    if (!messages.empty() && !is_away(gc) && !gc_data.options().mark_as_read_replying_only)
+        schedule_mark_as_read(gc);
 }
 
 
@@ -1014,19 +1908,38 @@ void mark_deferred_messages_as_read(PurpleConnection* gc, bool active)
     if ((is_away(gc) || gc_data.options().mark_as_read_replying_only) && !active)
         return;
 
-    vector<uint64> message_ids;
-    PurpleConversation* conv = find_active_conv(gc);
-    uint64 active_user_id;
-    uint64 active_chat_id;
-    find_active_ids(conv, &active_user_id, &active_chat_id);
-
-    for (const VkReceivedMessage& msg: gc_data.deferred_mark_as_read)
-        if (message_in_active(msg, active_user_id, active_chat_id))
-            message_ids.push_back(msg.msg_id);
-
-    erase_if(gc_data.deferred_mark_as_read, [=](const VkReceivedMessage& msg) {
-        return message_in_active(msg, active_user_id, active_chat_id);
-    });
+    take_active_deferred_messages(gc);
+    if (!gc_data.pending_mark_as_read.empty())
+        schedule_mark_as_read(gc);
+}
 
-    mark_messages_as_read_impl(gc, message_ids);
+void message_read_elsewhere(PurpleConnection* gc, uint64 peer_id, uint64 msg_id)
+{
+    VkData& gc_data = get_data(gc);
+    auto it = gc_data.unread_messages.end();
+    if (peer_id != 0) {
+        it = gc_data.unread_messages.find(peer_id);
+    } else {
+        // Only a few conversations have unread messages at any time.
+        for (it = gc_data.unread_messages.begin(); it != gc_data.unread_messages.end(); ++it)
+            if (contains(it->second, msg_id))
+                break;
+    }
+    if (it == gc_data.unread_messages.end() || it->second.erase(msg_id) == 0)
+        return;
+    peer_id = it->first;
+    if (it->second.empty())
+        gc_data.unread_messages.erase(it);
+
+    vkcom_debug_info("Message %llu has been read elsewhere\n", (unsigned long long)msg_id);
+    for (map<uint64, vector<uint64>>* messages: { &gc_data.deferred_mark_as_read,
+                                                  &gc_data.pending_mark_as_read }) {
+        auto peer_it = messages->find(peer_id);
+        if (peer_it == messages->end())
+            continue;
+        vector<uint64>& msg_ids = peer_it->second;
+        msg_ids.erase(std::remove(msg_ids.begin(), msg_ids.end(), msg_id), msg_ids.end());
+        if (msg_ids.empty())
+            messages->erase(peer_it);
+    }
 }
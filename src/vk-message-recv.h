@@ -6,19 +6,40 @@
 
 #include <connection.h>
 
+#include "contrib/picojson/picojson.h"
+
 // Callback called when messages are received. max_msg_id is the max id of received messages if any have been
 // received, zero otherwise.
 typedef function_ptr<void(uint64 max_msg_id)> ReceivedCb;
 
-// Receives all messages starting after from_msg_id. If last_msg_id is zero only unread incoming messages
-// are received, otherwise all messages (both sent and received) since last_msg_id are received, not including
-// last_msg_id.
+// Receives all messages (both sent and received) since last_msg_id, not including last_msg_id.
+// If last_msg_id is zero, only the last MAX_MESSAGES_ON_FIRST_TIME incoming and outgoing messages
+// are received. Unread incoming messages are shown first, the rest is written to logs afterwards
+// in chunks.
 void receive_messages_range(PurpleConnection* gc, uint64 last_msg_id, const ReceivedCb& received_cb);
 
+// Writes older messages, downloaded by the history backfill (fields are in the same format as in
+// messages.getHistory response), to logs. Messages must belong to one dialog and be ordered from
+// the oldest one. They are never shown in conversations or marked as read. done_cb is called
+// after the messages have been written.
+void receive_history_messages(PurpleConnection* gc, const picojson::array& items, const SuccessCb& done_cb);
+
 // Receives messages with given ids. Suitable for small amount of message_ids (< 100).
 void receive_messages(PurpleConnection* gc, const vector<uint64>& message_ids);
 
+// Processes the message, which has been received along with full attachments (fields are in the same
+// format as in messages.getById response), without calling messages.getById. Returns false if some
+// of the attachments lack required fields or cannot be rendered this way, the caller should use
+// receive_messages then.
+bool receive_message_from_fields(PurpleConnection* gc, const picojson::value& fields);
+
+// Writes the latest messages from the message store to the newly opened conversation. The number
+// of messages is set by recent_messages_on_open option.
+void show_recent_messages(PurpleConnection* gc, PurpleConversation* conv);
+
 // Marks messages as read or defers marking them until it is appropriate to mark them as read.
+// Messages are marked after a short delay, so that messages, received at once, are marked with
+// one call.
 void mark_message_as_read(PurpleConnection* gc, const vector<VkReceivedMessage>& messages);
 
 // Marks appropriate messages, which have been previously deferred, as read. Used when user does
@@ -26,3 +47,8 @@ void mark_message_as_read(PurpleConnection* gc, const vector<VkReceivedMessage>&
 // If active is true, the user has done something active: started typing, sent the message or
 // set status to available. This means, that whether the user is Available or Away is disregarded.
 void mark_deferred_messages_as_read(PurpleConnection* gc, bool active);
+
+// Updates the unread state of the message, reported by Long Poll: the message has been read
+// (possibly on another client) or deleted. Such messages are no longer marked as read by us.
+// peer_id is zero if Long Poll has not sent it.
+void message_read_elsewhere(PurpleConnection* gc, uint64 peer_id, uint64 msg_id);
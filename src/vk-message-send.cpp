@@ -8,6 +8,7 @@
 #include "vk-buddy.h"
 #include "vk-captcha.h"
 #include "vk-common.h"
+#include "vk-message-store.h"
 #include "vk-smileys.h"
 #include "vk-upload.h"
 #include "vk-utils.h"
@@ -42,6 +43,9 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
 // Add error message to debug log, message window and call error_cb
 void show_error(PurpleConnection* gc, const SendMessage& message);
 
+// Appends the part of the message, which has been sent as msg_id, to the message store.
+void store_sent_message(PurpleConnection* gc, const SendMessage& message, uint64 msg_id, const string& text);
+
 } // End of anonymous namespace
 
 int send_im_message(PurpleConnection* gc, uint64 user_id, const char* raw_message,
@@ -274,11 +278,13 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
     if (!captcha_key.empty())
         params.emplace_back("captcha_key", captcha_key);
 
-    get_data(gc).set_last_msg_sent_time(steady_clock::now());
+    uint64 random_id = get_data(gc).add_sent_msg();
+    params.emplace_back("random_id", to_string(random_id));
 
     vk_call_api(gc, "messages.send", params, [=](const picojson::value& v) {
         if (!v.is<double>()) {
             vkcom_debug_error("Wrong response from message.send: %s\n", v.serialize().data());
+            get_data(gc).remove_sent_msg(random_id);
             show_error(gc, *message);
             return;
         }
@@ -286,7 +292,8 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
         // NOTE: We do not set last_msg_id here, because it is done when corresponding notification is received
         // in longpoll.
         uint64 msg_id = v.get<double>();
-        get_data(gc).add_sent_msg_id(msg_id);
+        get_data(gc).set_sent_msg_id(random_id, msg_id);
+        store_sent_message(gc, *message, msg_id, message->text.substr(0, sent_len));
 
         // Check if we have sent the whole message.
         if (sent_len == message->text.length()) {
@@ -304,10 +311,28 @@ void send_message_internal(PurpleConnection* gc, const SendMessage_ptr& message,
         if (message->success_cb)
             message->success_cb();
     }, [=](const picojson::value& error) {
+        get_data(gc).remove_sent_msg(random_id);
         process_im_error(error, gc, message);
     });
 }
 
+void store_sent_message(PurpleConnection* gc, const SendMessage& message, uint64 msg_id, const string& text)
+{
+    StoredMessage stored;
+    stored.msg_id = msg_id;
+    stored.peer_id = peer_id_from_ids(message.user_id, message.chat_id);
+    stored.outgoing = true;
+    stored.timestamp = time(nullptr);
+    if (message.chat_id != 0)
+        stored.from = get_self_chat_display_name(gc);
+    else
+        stored.from = purple_account_get_name_for_display(purple_connection_get_account(gc));
+    char* escaped = purple_markup_escape_text(text.data(), -1);
+    stored.text = escaped;
+    g_free(escaped);
+    get_message_store(gc).append(stored);
+}
+
 void process_im_error(const picojson::value& error, PurpleConnection* gc, const SendMessage_ptr& message)
 {
     if (!error.is<picojson::object>() || !field_is_present<double>(error, "error_code")) {
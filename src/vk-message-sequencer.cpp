@@ -0,0 +1,83 @@
+#include "vk-message-sequencer.h"
+
+namespace
+{
+
+// Later messages wait for the held message no longer than this (in msec). Receiving a message
+// with attachments takes messages.getById, thumbnail downloads (up to THUMBNAIL_DOWNLOADS_DEADLINE,
+// 15 seconds, see vk-message-recv.cpp) and user infos, so the bound must be well above that.
+const unsigned MAX_HOLD_TIME = 30000;
+
+} // End of anonymous namespace
+
+MessageSequencer::MessageSequencer(PurpleConnection* gc)
+    : m_gc(gc)
+{
+}
+
+void MessageSequencer::hold(uint64 peer_id, uint64 msg_id)
+{
+    m_peers[peer_id].held.insert(msg_id);
+
+    PurpleConnection* gc = m_gc;
+    timeout_add(m_gc, MAX_HOLD_TIME, [=] {
+        get_message_sequencer(gc).release(peer_id, msg_id);
+        return false;
+    });
+}
+
+void MessageSequencer::deliver(uint64 peer_id, uint64 msg_id, const SuccessCb& deliver_cb)
+{
+    auto it = m_peers.find(peer_id);
+    // Nothing is being received in this conversation, which is the common case.
+    if (it == m_peers.end()) {
+        deliver_cb();
+        return;
+    }
+
+    it->second.held.erase(msg_id);
+    it->second.ready[msg_id] = deliver_cb;
+    flush(peer_id);
+}
+
+void MessageSequencer::release(uint64 peer_id, uint64 msg_id)
+{
+    auto it = m_peers.find(peer_id);
+    if (it == m_peers.end() || it->second.held.erase(msg_id) == 0)
+        return;
+
+    vkcom_debug_error("Message %llu has not been received in time, not waiting for it\n",
+                      (unsigned long long)msg_id);
+    flush(peer_id);
+}
+
+void MessageSequencer::flush(uint64 peer_id)
+{
+    while (true) {
+        // The callbacks may hold or deliver other messages, so the queue is looked up every time.
+        auto it = m_peers.find(peer_id);
+        if (it == m_peers.end())
+            return;
+        PeerQueue& queue = it->second;
+        if (queue.ready.empty()) {
+            if (queue.held.empty())
+                m_peers.erase(it);
+            return;
+        }
+
+        auto next = queue.ready.begin();
+        if (!queue.held.empty() && *queue.held.begin() < next->first)
+            return;
+        SuccessCb deliver_cb = std::move(next->second);
+        queue.ready.erase(next);
+        deliver_cb();
+    }
+}
+
+MessageSequencer& get_message_sequencer(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.message_sequencer)
+        gc_data.message_sequencer.reset(new MessageSequencer(gc));
+    return *gc_data.message_sequencer;
+}
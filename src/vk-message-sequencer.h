@@ -0,0 +1,51 @@
+// Keeping the order of messages, which are delivered via different paths.
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+
+#include "vk-common.h"
+
+// Plain-text messages from Long Poll are written to conversations immediately, while messages
+// with attachments (or from unknown peers) are received in background and can be written seconds
+// later. MessageSequencer holds back messages in a conversation only while an earlier message
+// in the same conversation is being received, so that a text, sent after a photo, is not shown
+// before the photo. Conversations never wait for each other and a held message is waited for
+// no longer than half a minute (it may fail to be received at all).
+class MessageSequencer
+{
+public:
+    MessageSequencer(PurpleConnection* gc);
+
+    DISABLE_COPYING(MessageSequencer)
+
+    // Marks the message as being received in background. peer_id is user id or chat id
+    // + CHAT_ID_OFFSET, see peer_id_from_ids.
+    void hold(uint64 peer_id, uint64 msg_id);
+
+    // Calls deliver_cb immediately if no earlier message in the conversation is held, otherwise
+    // after all of them have been delivered or have expired. Releases the message if it has been
+    // held.
+    void deliver(uint64 peer_id, uint64 msg_id, const SuccessCb& deliver_cb);
+
+private:
+    struct PeerQueue
+    {
+        set<uint64> held;
+        // Messages, which wait for the earlier held ones, by message id.
+        map<uint64, SuccessCb> ready;
+    };
+
+    PurpleConnection* m_gc;
+    map<uint64, PeerQueue> m_peers;
+
+    // Stops waiting for the message, called when the wait has expired.
+    void release(uint64 peer_id, uint64 msg_id);
+    // Delivers ready messages, which no held message precedes.
+    void flush(uint64 peer_id);
+};
+
+// Returns message sequencer for the account, creating it upon first use.
+MessageSequencer& get_message_sequencer(PurpleConnection* gc);
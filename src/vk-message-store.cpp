@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <glib/gstdio.h>
+#include <util.h>
+
+#include "vk-message-store.h"
+
+namespace
+{
+
+// A new segment is started after the current one reaches this size.
+const uint64 MAX_SEGMENT_SIZE = 16 * 1024 * 1024;
+const uint32_t NO_SEGMENT = uint32_t(-1);
+
+const char INDEX_FILENAME[] = "index";
+
+// Record in the index file.
+struct IndexRecord
+{
+    uint64 peer_id;
+    uint64 msg_id;
+    int64 timestamp;
+    uint32_t segment;
+    uint32_t offset;
+};
+
+// Header of the message record in the segment file, followed by from and text.
+struct MessageHeader
+{
+    uint64 msg_id;
+    uint64 peer_id;
+    int64 timestamp;
+    uint32_t outgoing;
+    uint32_t from_size;
+    uint32_t text_size;
+    uint32_t reserved;
+};
+
+string get_message_store_dir(PurpleConnection* gc)
+{
+    PurpleAccount* account = purple_connection_get_account(gc);
+    string dirname = str_format("%s-messages", purple_escape_filename(purple_account_get_username(account)));
+
+    char* path = g_build_filename(purple_user_dir(), "vkcom", dirname.data(), nullptr);
+    string ret = path;
+    g_free(path);
+    return ret;
+}
+
+} // End of anonymous namespace
+
+MessageStore::MessageStore(const string& dir)
+    : m_dir(dir),
+      m_failed(false),
+      m_segment(0),
+      m_segment_size(0),
+      m_read_segment(NO_SEGMENT)
+{
+    if (g_mkdir_with_parents(m_dir.data(), 0700) != 0) {
+        vkcom_debug_error("Unable to create message store %s: %s\n", m_dir.data(), strerror(errno));
+        m_failed = true;
+        return;
+    }
+
+    load_index();
+
+    string index_path = m_dir + G_DIR_SEPARATOR_S + INDEX_FILENAME;
+    m_index_file.open(index_path.data(), std::ios::binary | std::ios::app);
+    if (!m_index_file.is_open() || !open_segment(m_segment)) {
+        vkcom_debug_error("Unable to open message store %s: %s\n", m_dir.data(), strerror(errno));
+        m_failed = true;
+    }
+}
+
+bool MessageStore::append(const StoredMessage& message)
+{
+    if (m_failed || contains(message.peer_id, message.msg_id))
+        return false;
+
+    if (m_segment_size >= MAX_SEGMENT_SIZE && !open_segment(m_segment + 1)) {
+        m_failed = true;
+        return false;
+    }
+
+    MessageHeader header = { message.msg_id, message.peer_id, message.timestamp, message.outgoing,
+                             (uint32_t)message.from.size(), (uint32_t)message.text.size(), 0 };
+    m_segment_file.write((const char*)&header, sizeof(header));
+    m_segment_file.write(message.from.data(), message.from.size());
+    m_segment_file.write(message.text.data(), message.text.size());
+    // The index record is written after the message, so that it never points to missing data.
+    IndexRecord record = { message.peer_id, message.msg_id, message.timestamp, m_segment,
+                           (uint32_t)m_segment_size };
+    m_segment_file.flush();
+    m_index_file.write((const char*)&record, sizeof(record));
+    m_index_file.flush();
+    if (m_segment_file.fail() || m_index_file.fail()) {
+        vkcom_debug_error("Error writing to message store %s: %s\n", m_dir.data(), strerror(errno));
+        m_failed = true;
+        return false;
+    }
+
+    IndexEntry entry = { message.msg_id, message.timestamp, m_segment, (uint32_t)m_segment_size };
+    m_segment_size += sizeof(header) + message.from.size() + message.text.size();
+
+    // Messages mostly arrive in the order of ids, older ones come from the history download.
+    DialogIndex& index = m_index[message.peer_id];
+    if (index.empty() || index.back().msg_id < message.msg_id) {
+        index.push_back(entry);
+    } else {
+        auto it = std::lower_bound(index.begin(), index.end(), message.msg_id,
+                                   [](const IndexEntry& e, uint64 msg_id) {
+            return e.msg_id < msg_id;
+        });
+        index.insert(it, entry);
+    }
+    return true;
+}
+
+bool MessageStore::contains(uint64 peer_id, uint64 msg_id) const
+{
+    auto index_it = m_index.find(peer_id);
+    if (index_it == m_index.end())
+        return false;
+    const DialogIndex& index = index_it->second;
+    auto it = std::lower_bound(index.begin(), index.end(), msg_id, [](const IndexEntry& e, uint64 id) {
+        return e.msg_id < id;
+    });
+    return it != index.end() && it->msg_id == msg_id;
+}
+
+vector<StoredMessage> MessageStore::get_latest(uint64 peer_id, size_t count)
+{
+    auto index_it = m_index.find(peer_id);
+    if (index_it == m_index.end())
+        return {};
+    const DialogIndex& index = index_it->second;
+    return read_messages(peer_id, index.end() - std::min(count, index.size()), index.end());
+}
+
+void MessageStore::load_index()
+{
+    string index_path = m_dir + G_DIR_SEPARATOR_S + INDEX_FILENAME;
+    std::ifstream file(index_path.data(), std::ios::binary);
+    if (!file.is_open())
+        return;
+
+    // Records, which point past the end of their segments, are left from interrupted writes.
+    map<uint32_t, uint64> segment_sizes;
+    size_t count = 0;
+    IndexRecord record;
+    while (file.read((char*)&record, sizeof(record))) {
+        if (segment_sizes.count(record.segment) == 0) {
+            GStatBuf buf;
+            if (g_stat(get_segment_path(record.segment).data(), &buf) == 0)
+                segment_sizes[record.segment] = buf.st_size;
+            else
+                segment_sizes[record.segment] = 0;
+        }
+        if (record.offset + sizeof(MessageHeader) > segment_sizes[record.segment])
+            continue;
+
+        m_index[record.peer_id].push_back({ record.msg_id, record.timestamp, record.segment,
+                                            record.offset });
+        m_segment = std::max(m_segment, record.segment);
+        count++;
+    }
+
+    // A partial record at the end would misalign all the following ones.
+    file.clear();
+    file.seekg(0, std::ios::end);
+    if ((uint64)file.tellg() % sizeof(IndexRecord) != 0) {
+        vkcom_debug_error("Message store index %s has a partial record, rewriting it\n", index_path.data());
+        file.close();
+        rewrite_index();
+    }
+
+    for (pair<const uint64, DialogIndex>& p: m_index) {
+        DialogIndex& index = p.second;
+        auto msg_id_less = [](const IndexEntry& a, const IndexEntry& b) {
+            return a.msg_id < b.msg_id;
+        };
+        if (!std::is_sorted(index.begin(), index.end(), msg_id_less))
+            std::stable_sort(index.begin(), index.end(), msg_id_less);
+    }
+    vkcom_debug_info("Loaded message store index: %zu messages in %zu dialogs\n", count, m_index.size());
+}
+
+void MessageStore::rewrite_index()
+{
+    string index_path = m_dir + G_DIR_SEPARATOR_S + INDEX_FILENAME;
+    std::ofstream file(index_path.data(), std::ios::binary | std::ios::trunc);
+    for (const pair<const uint64, DialogIndex>& p: m_index) {
+        for (const IndexEntry& entry: p.second) {
+            IndexRecord record = { p.first, entry.msg_id, entry.timestamp, entry.segment, entry.offset };
+            file.write((const char*)&record, sizeof(record));
+        }
+    }
+}
+
+bool MessageStore::open_segment(uint32_t segment)
+{
+    m_segment_file.close();
+    m_segment_file.clear();
+    m_segment = segment;
+    m_segment_file.open(get_segment_path(segment).data(), std::ios::binary | std::ios::app);
+    if (!m_segment_file.is_open()) {
+        vkcom_debug_error("Unable to open message store segment %u: %s\n", segment, strerror(errno));
+        return false;
+    }
+    // tellp is zero for a newly opened file in append mode, so we seek to the end.
+    m_segment_file.seekp(0, std::ios::end);
+    m_segment_size = m_segment_file.tellp();
+    return true;
+}
+
+string MessageStore::get_segment_path(uint32_t segment) const
+{
+    return m_dir + G_DIR_SEPARATOR_S + str_format("%06u.segment", segment);
+}
+
+bool MessageStore::read_message(uint64 peer_id, const IndexEntry& entry, StoredMessage& message)
+{
+    if (m_read_segment != entry.segment) {
+        m_read_file.close();
+        m_read_file.clear();
+        m_read_file.open(get_segment_path(entry.segment).data(), std::ios::binary);
+        m_read_segment = entry.segment;
+    }
+    // The stream could have hit the end of the segment, which has grown since.
+    m_read_file.clear();
+    m_read_file.seekg(entry.offset);
+
+    MessageHeader header;
+    if (!m_read_file.read((char*)&header, sizeof(header)) || header.msg_id != entry.msg_id
+            || header.peer_id != peer_id) {
+        vkcom_debug_error("Message store is corrupted at segment %u offset %u\n", entry.segment,
+                          entry.offset);
+        return false;
+    }
+
+    message.msg_id = header.msg_id;
+    message.peer_id = header.peer_id;
+    message.outgoing = header.outgoing != 0;
+    message.timestamp = header.timestamp;
+    message.from.resize(header.from_size);
+    message.text.resize(header.text_size);
+    if (!m_read_file.read(&message.from[0], header.from_size)
+            || !m_read_file.read(&message.text[0], header.text_size)) {
+        vkcom_debug_error("Message store is corrupted at segment %u offset %u\n", entry.segment,
+                          entry.offset);
+        return false;
+    }
+    return true;
+}
+
+vector<StoredMessage> MessageStore::read_messages(uint64 peer_id, DialogIndex::const_iterator begin,
+                                                  DialogIndex::const_iterator end)
+{
+    vector<StoredMessage> messages;
+    messages.reserve(end - begin);
+    for (auto it = begin; it != end; ++it) {
+        messages.emplace_back();
+        if (!read_message(peer_id, *it, messages.back()))
+            messages.pop_back();
+    }
+    return messages;
+}
+
+MessageStore& get_message_store(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.message_store)
+        gc_data.message_store.reset(new MessageStore(get_message_store_dir(gc)));
+    return *gc_data.message_store;
+}
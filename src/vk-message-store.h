@@ -0,0 +1,90 @@
+// Local store of received and sent messages.
+
+#pragma once
+
+#include <fstream>
+
+#include "common.h"
+
+#include <connection.h>
+
+#include "vk-common.h"
+
+// One message in the store.
+struct StoredMessage
+{
+    uint64 msg_id;
+    // User id or chat id + CHAT_ID_OFFSET, see peer_id_from_ids.
+    uint64 peer_id;
+    bool outgoing;
+    time_t timestamp;
+    // Author name and text in the same form as they have been written to conversation. Thumbnails
+    // are replaced with links, because imgstore ids do not outlive the session.
+    string from;
+    string text;
+};
+
+// Append-only per-account message store. Messages are appended to segment files (a new segment is
+// started when the current one grows over the size limit) and each message gets a fixed-size record
+// in the index file. The index is loaded into memory upon first use and is kept sorted by message
+// id for each dialog, so lookups by (peer id, message id) are binary searches and the latest
+// messages are at the end (message ids grow with time). Reading a message costs one seek in its
+// segment.
+//
+// The store is used to check whether a message has already been seen and to show recent messages
+// when a conversation is opened without going to the server.
+class MessageStore
+{
+public:
+    // Opens the store in directory dir, creating it if needed.
+    MessageStore(const string& dir);
+
+    DISABLE_COPYING(MessageStore)
+
+    // Appends the message unless it is already present. Returns false if the message is present
+    // or could not be written.
+    bool append(const StoredMessage& message);
+
+    // Returns true if the message is present in the dialog.
+    bool contains(uint64 peer_id, uint64 msg_id) const;
+
+    // Returns up to count latest messages of the dialog, ordered from the oldest one.
+    vector<StoredMessage> get_latest(uint64 peer_id, size_t count);
+
+private:
+    // In-memory index entry, the index for each dialog is sorted by msg_id.
+    struct IndexEntry
+    {
+        uint64 msg_id;
+        int64 timestamp;
+        uint32_t segment;
+        uint32_t offset;
+    };
+    typedef vector<IndexEntry> DialogIndex;
+
+    string m_dir;
+    map<uint64, DialogIndex> m_index;
+    // Set if the store could not be opened or written, no further writes are made.
+    bool m_failed;
+
+    // Segment, which is being appended to.
+    std::ofstream m_segment_file;
+    uint32_t m_segment;
+    uint64 m_segment_size;
+    std::ofstream m_index_file;
+
+    // Segment, which has been read last, kept open for consecutive reads.
+    std::ifstream m_read_file;
+    uint32_t m_read_segment;
+
+    void load_index();
+    void rewrite_index();
+    bool open_segment(uint32_t segment);
+    string get_segment_path(uint32_t segment) const;
+    bool read_message(uint64 peer_id, const IndexEntry& entry, StoredMessage& message);
+    vector<StoredMessage> read_messages(uint64 peer_id, DialogIndex::const_iterator begin,
+                                        DialogIndex::const_iterator end);
+};
+
+// Returns message store for the account, opening it upon first use.
+MessageStore& get_message_store(PurpleConnection* gc);
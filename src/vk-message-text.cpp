@@ -0,0 +1,52 @@
+#include "vk-message-text.h"
+
+MessageText& MessageText::operator+=(const string& text)
+{
+    if (text.empty())
+        return *this;
+    if (m_segments.empty() || m_segments.back().is_hole) {
+        m_segments.emplace_back();
+        m_segments.back().is_hole = false;
+    }
+    m_segments.back().text += text;
+    return *this;
+}
+
+MessageText& MessageText::operator+=(const char* text)
+{
+    if (*text == '\0')
+        return *this;
+    if (m_segments.empty() || m_segments.back().is_hole) {
+        m_segments.emplace_back();
+        m_segments.back().is_hole = false;
+    }
+    m_segments.back().text += text;
+    return *this;
+}
+
+MessageText& MessageText::operator+=(const MessageText& text)
+{
+    for (const Segment& segment: text.m_segments) {
+        if (segment.is_hole)
+            append_hole(segment.type, segment.id);
+        else
+            *this += segment.text;
+    }
+    return *this;
+}
+
+void MessageText::append_hole(HoleType type, uint64 id)
+{
+    m_segments.emplace_back();
+    Segment& segment = m_segments.back();
+    segment.is_hole = true;
+    segment.type = type;
+    segment.id = id;
+}
+
+void MessageText::replace_literal(const string& from, const string& to)
+{
+    for (Segment& segment: m_segments)
+        if (!segment.is_hole)
+            str_replace(segment.text, from, to);
+}
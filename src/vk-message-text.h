@@ -0,0 +1,81 @@
+// Text of received messages with parts, which become known only later.
+
+#pragma once
+
+#include "common.h"
+
+// Message text is built when the message is processed, but some of its parts are not known at that
+// time: thumbnails have to be downloaded and names of unknown users and groups have to be
+// requested. Instead of inserting textual placeholders and replacing them one by one (which costs
+// a pass over the whole text for each placeholder), the text is stored as a list of literal
+// segments and typed holes. The holes are resolved only once, when the text is rendered.
+class MessageText
+{
+public:
+    enum HoleType {
+        // Thumbnail, id is the index into Message::thumbnail_urls.
+        THUMBNAIL,
+        // Link to user page, id is user id.
+        USER,
+        // Link to group page, id is group id.
+        GROUP
+    };
+
+    // Appends literal text.
+    MessageText& operator+=(const string& text);
+    MessageText& operator+=(const char* text);
+    // Appends another text together with its holes.
+    MessageText& operator+=(const MessageText& text);
+    // Appends a hole, which will be resolved upon rendering.
+    void append_hole(HoleType type, uint64 id);
+
+    // Returns true if neither literal text nor holes have been appended.
+    bool empty() const
+    {
+        return m_segments.empty();
+    }
+
+    // Replaces all occurences of from in literal segments with to. Holes are not affected.
+    void replace_literal(const string& from, const string& to);
+
+    // Returns the resulting text. resolve(HoleType type, uint64 id) must return the text for each
+    // hole. All holes are resolved first, so that the result is allocated only once.
+    template<typename Resolver>
+    string render(Resolver resolve) const
+    {
+        vector<string> holes;
+        size_t size = 0;
+        for (const Segment& segment: m_segments) {
+            if (segment.is_hole) {
+                holes.push_back(resolve(segment.type, segment.id));
+                size += holes.back().size();
+            } else {
+                size += segment.text.size();
+            }
+        }
+
+        string ret;
+        ret.reserve(size);
+        size_t hole_num = 0;
+        for (const Segment& segment: m_segments) {
+            if (segment.is_hole)
+                ret += holes[hole_num++];
+            else
+                ret += segment.text;
+        }
+        return ret;
+    }
+
+private:
+    struct Segment
+    {
+        bool is_hole;
+        // Only for holes.
+        HoleType type;
+        uint64 id;
+        // Only for literal segments.
+        string text;
+    };
+    // Adjacent literal segments are always merged.
+    vector<Segment> m_segments;
+};
@@ -5,6 +5,7 @@
 #include <util.h>
 #include <version.h>
 
+#include "httpcache.h"
 #include "httputils.h"
 #include "miscutils.h"
 #include "vk-api.h"
@@ -13,10 +14,13 @@
 #include "vk-common.h"
 #include "vk-filexfer.h"
 #include "vk-longpoll.h"
+#include "vk-log-writer.h"
+#include "vk-longpoll-journal.h"
 #include "vk-message-recv.h"
 #include "vk-message-send.h"
 #include "vk-smileys.h"
 #include "vk-status.h"
+#include "vk-thumbnail-images.h"
 #include "vk-utils.h"
 
 
@@ -127,6 +131,40 @@ void conversation_updated(PurpleConversation* conv, PurpleConvUpdateType type, g
     }
 }
 
+// Signal handler for conversation-created signal. The signal is emitted before the message, which
+// caused the conversation to open, is written.
+void conversation_created(PurpleConversation* conv, gpointer data)
+{
+    PurpleConnection* gc = (PurpleConnection*)data;
+
+    // This is not our conversation.
+    if (gc != purple_conversation_get_gc(conv))
+        return;
+
+    // Messages, which have been written to the log before the conversation was opened, must be
+    // in a log, which has been closed before the conversation one.
+    VkData& gc_data = get_data(gc);
+    uint64 peer_id = peer_id_from_conv(conv);
+    if (peer_id != 0 && gc_data.log_writer)
+        gc_data.log_writer->close_logs(peer_id);
+
+    show_recent_messages(gc, conv);
+}
+
+// Signal handler for deleting-conversation signal.
+void deleting_conversation(PurpleConversation* conv, gpointer data)
+{
+    PurpleConnection* gc = (PurpleConnection*)data;
+
+    // This is not our conversation.
+    if (gc != purple_conversation_get_gc(conv))
+        return;
+
+    uint64 peer_id = peer_id_from_conv(conv);
+    if (peer_id != 0)
+        get_thumbnail_images(gc).release_conversation(peer_id);
+}
+
 void conversation_received_msg(PurpleAccount* /*account*/, const char* /*who*/, const char* message,
                                   PurpleConversation* conv, PurpleMessageFlags /*flags*/,
                                   gpointer data)
@@ -314,6 +352,10 @@ void vk_login(PurpleAccount* account)
             return true;
         });
 
+        purple_signal_connect(purple_conversations_get_handle(), "conversation-created", gc,
+                              PURPLE_CALLBACK(conversation_created), gc);
+        purple_signal_connect(purple_conversations_get_handle(), "deleting-conversation", gc,
+                              PURPLE_CALLBACK(deleting_conversation), gc);
         purple_signal_connect(purple_conversations_get_handle(), "conversation-updated", gc,
                               PURPLE_CALLBACK(conversation_updated), gc);
         purple_signal_connect(purple_conversations_get_handle(), "received-im-msg", gc,
@@ -328,6 +370,10 @@ void vk_close(PurpleConnection* gc)
 {
     vkcom_debug_info("Closing connection\n");
 
+    purple_signal_disconnect(purple_conversations_get_handle(), "conversation-created", gc,
+                          PURPLE_CALLBACK(conversation_created));
+    purple_signal_disconnect(purple_conversations_get_handle(), "deleting-conversation", gc,
+                          PURPLE_CALLBACK(deleting_conversation));
     purple_signal_disconnect(purple_conversations_get_handle(), "conversation-updated", gc,
                           PURPLE_CALLBACK(conversation_updated));
     purple_signal_disconnect(purple_conversations_get_handle(), "received-im-msg", gc,
@@ -340,10 +386,16 @@ void vk_close(PurpleConnection* gc)
     // we cannot defer destruction of PurpleConnection and doing the "right way" is such a bother.
     g_usleep(250000);
 
+    stop_long_poll(gc);
+
     VkData& data = get_data(gc);
     data.set_closing();
 
     purple_request_close_with_handle(gc);
+    // Downloads, which wait for a retry timer, never finish, so they are dropped before cancelling
+    // the running ones.
+    cancel_http_cache_requests(gc);
+    cancel_buddy_icon_fetches(gc);
     // TODO: Pidgin crashes if we cancel more than one http_get request in here. Either do not
     // run parallel requests when fetching buddy icons or do something with timeouts.
     purple_http_conn_cancel_all(gc);
@@ -409,11 +461,9 @@ void vk_get_info(PurpleConnection* gc, const char* who)
         return;
     }
 
-    http_get(gc, user_info->photo_max,
-    [=](PurpleHttpConnection*, PurpleHttpResponse* response) {
-        if (purple_http_response_is_successful(response)) {
-            size_t size;
-            const char* data = purple_http_response_get_data(response, &size);
+    http_get_cached(gc, user_info->photo_max,
+    [=](const char* data, size_t size) {
+        if (data) {
             int img_id = purple_imgstore_add_with_id(g_memdup(data, size), size, nullptr);
             if (img_id != 0) {
                 string img = str_format("<img id='%d'>", img_id);
@@ -478,6 +528,7 @@ void vk_remove_buddy(PurpleConnection* gc, PurpleBuddy* buddy, PurpleGroup*)
         return;
 
     get_data(gc).set_manually_removed_buddy(user_id);
+    invalidate_user_names(gc, user_id);
 }
 
 void vk_chat_join(PurpleConnection* gc, GHashTable* components)
@@ -566,8 +617,11 @@ int vk_chat_send(PurpleConnection* gc, int conv_id, const char* message, PurpleM
     return send_chat_message(gc, chat_id, message);
 }
 
-void vk_alias_buddy(PurpleConnection* gc, const char *, const char *)
+void vk_alias_buddy(PurpleConnection* gc, const char* who, const char*)
 {
+    uint64 user_id = user_id_from_name(who);
+    if (user_id != 0)
+        invalidate_user_names(gc, user_id);
     // Recheck all open chats and update because they could contain the aliased buddy.
     update_all_open_chat_convs(gc);
 }
@@ -803,6 +857,64 @@ PurplePluginProtocolInfo prpl_info = {
 #endif // PURPLE_VERSION_CHECK(2, 8, 0)
 };
 
+// Helper for vk_replay_journal_action.
+struct ReplayJournalData
+{
+    PurpleConnection* gc;
+    bool realtime;
+};
+
+// Called after user selects journal file.
+void replay_journal_ok(ReplayJournalData* data, const char* filename)
+{
+    if (filename)
+        replay_long_poll_journal(data->gc, filename, data->realtime);
+    delete data;
+}
+
+void replay_journal_cancel(ReplayJournalData* data)
+{
+    delete data;
+}
+
+// Asks for the journal file and replays it.
+void request_replay_journal(PurplePluginAction* action, bool realtime)
+{
+    PurpleConnection* gc = (PurpleConnection*)action->context;
+    ReplayJournalData* data = new ReplayJournalData({ gc, realtime });
+    string path = get_long_poll_journal_path(gc);
+    purple_request_file(gc, i18n("Replay Long Poll journal"), path.data(), false,
+                        G_CALLBACK(replay_journal_ok), G_CALLBACK(replay_journal_cancel),
+                        purple_connection_get_account(gc), nullptr, nullptr, data);
+}
+
+void replay_journal_action(PurplePluginAction* action)
+{
+    request_replay_journal(action, true);
+}
+
+void replay_journal_fast_action(PurplePluginAction* action)
+{
+    request_replay_journal(action, false);
+}
+
+// Account actions. The only ones we have are for debugging, so they are shown only when
+// long_poll_journal option is set.
+GList* vk_actions(PurplePlugin*, gpointer context)
+{
+    PurpleConnection* gc = (PurpleConnection*)context;
+    if (!gc || !purple_connection_get_protocol_data(gc) || !get_data(gc).options().long_poll_journal)
+        return nullptr;
+
+    GList* actions = nullptr;
+    actions = g_list_append(actions, purple_plugin_action_new(i18n("Replay Long Poll journal"),
+                                                              replay_journal_action));
+    actions = g_list_append(actions, purple_plugin_action_new(i18n("Replay Long Poll journal "
+                                                                   "(as fast as possible)"),
+                                                              replay_journal_fast_action));
+    return actions;
+}
+
 gboolean load_plugin(PurplePlugin*)
 {
     purple_http_init();
@@ -836,7 +948,7 @@ PurplePluginInfo info = {
     nullptr, /* ui_info */
     &prpl_info, /* extra_info */
     nullptr, /* prefs_info */
-    nullptr, /* actions */
+    vk_actions, /* actions */
     nullptr, /* reserved1 */
     nullptr, /* reserved2 */
     nullptr, /* reserved3 */
@@ -882,6 +994,26 @@ void vkcom_prpl_init(PurplePlugin*)
 
     option = purple_account_option_string_new(i18n("Group for chats"), "blist_chat_group", "");
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Simultaneous thumbnail downloads"),
+                                           "thumbnail_downloads_per_host", 4);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Maximum thumbnail size, bigger variants are not downloaded (pixels)"),
+                                           "thumbnail_max_size", 320);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Older messages per conversation to download to logs"),
+                                           "backfill_messages_per_dialog", 1000);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_int_new(i18n("Recent messages to show in new conversations"),
+                                           "recent_messages_on_open", 10);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_bool_new(i18n("Record Long Poll journal (for debugging)"),
+                                            "long_poll_journal", false);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 }
 
 extern "C"
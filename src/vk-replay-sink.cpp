@@ -0,0 +1,85 @@
+#include <glib/gstdio.h>
+
+#include "vk-message-store.h"
+
+#include "vk-replay-sink.h"
+
+ReplaySink::ReplaySink(PurpleConnection* gc)
+    : m_gc(gc),
+      m_live_data(&get_data(gc)),
+      m_sandbox(new VkData(gc, "", ""))
+{
+    // Processing reads user, chat and buddy list state, so the sandbox starts with a copy of it.
+    // The rest of the state (unread messages, sent messages and the sequencer) starts empty.
+    const VkData& live = *m_live_data;
+    m_sandbox->friend_user_ids = live.friend_user_ids;
+    m_sandbox->dialog_user_ids = live.dialog_user_ids;
+    m_sandbox->user_infos = live.user_infos;
+    m_sandbox->chat_ids = live.chat_ids;
+    m_sandbox->chat_infos = live.chat_infos;
+    m_sandbox->group_infos = live.group_infos;
+    m_sandbox->name_cache = live.name_cache;
+    m_sandbox->blist_buddies = live.blist_buddies;
+    m_sandbox->blist_chats = live.blist_chats;
+    m_sandbox->chat_conv_ids = live.chat_conv_ids;
+    m_sandbox->replay_sink = this;
+
+    // Replayed messages are appended to the store as usual, but not to the account's one.
+    char* dir = g_dir_make_tmp("purple-vkcom-replay-XXXXXX", nullptr);
+    if (dir) {
+        m_store_dir = dir;
+        g_free(dir);
+        m_sandbox->message_store.reset(new MessageStore(m_store_dir));
+    } else {
+        vkcom_debug_error("Unable to create temporary directory for replayed messages\n");
+    }
+}
+
+ReplaySink::~ReplaySink()
+{
+    // The store must be closed before its files are removed.
+    m_sandbox.reset();
+    if (m_store_dir.empty())
+        return;
+
+    GDir* dir = g_dir_open(m_store_dir.data(), 0, nullptr);
+    if (dir) {
+        while (const char* filename = g_dir_read_name(dir)) {
+            char* path = g_build_filename(m_store_dir.data(), filename, nullptr);
+            g_remove(path);
+            g_free(path);
+        }
+        g_dir_close(dir);
+    }
+    g_rmdir(m_store_dir.data());
+}
+
+void ReplaySink::enter()
+{
+    purple_connection_set_protocol_data(m_gc, m_sandbox.get());
+}
+
+void ReplaySink::leave()
+{
+    purple_connection_set_protocol_data(m_gc, m_live_data);
+}
+
+void ReplaySink::drop(const char* what)
+{
+    m_dropped[what]++;
+}
+
+void ReplaySink::log_dropped() const
+{
+    for (const pair<const string, unsigned>& p: m_dropped)
+        vkcom_debug_info("Dropped %u calls to %s\n", p.second, p.first.data());
+}
+
+bool dropped_in_replay(PurpleConnection* gc, const char* what)
+{
+    ReplaySink* sink = get_data(gc).replay_sink;
+    if (!sink)
+        return false;
+    sink->drop(what);
+    return true;
+}
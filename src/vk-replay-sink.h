@@ -0,0 +1,44 @@
+// Isolation of Long Poll journal replay from the account.
+
+#pragma once
+
+#include "common.h"
+
+#include <connection.h>
+
+#include "vk-common.h"
+
+// Replayed Long Poll events (see replay_long_poll_journal) are processed by the usual code, but
+// against a separate VkData, which is swapped in for the connection only while the events are
+// processed. The sandbox is a copy of the user, chat and buddy list state and has its own message
+// store in a temporary directory. Everything, which would leave the sandbox (API calls, HTTP
+// requests, timers, writes to conversations, logs and buddy list), is dropped at the boundary
+// by dropped_in_replay and counted here.
+class ReplaySink
+{
+public:
+    // Creates the sandbox from the current state of gc.
+    ReplaySink(PurpleConnection* gc);
+    // Destroys the sandbox and removes its message store.
+    ~ReplaySink();
+
+    DISABLE_COPYING(ReplaySink)
+
+    // Swaps the sandbox in for the connection and back. Every call to enter must be paired with
+    // leave before returning to the main loop.
+    void enter();
+    void leave();
+
+    // Counts the dropped call.
+    void drop(const char* what);
+
+    // Logs the number of dropped calls of each kind.
+    void log_dropped() const;
+
+private:
+    PurpleConnection* m_gc;
+    VkData* m_live_data;
+    shared_ptr<VkData> m_sandbox;
+    string m_store_dir;
+    map<string, unsigned> m_dropped;
+};
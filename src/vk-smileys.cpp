@@ -1,5 +1,12 @@
 #include <fstream>
 #include <glib.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VK_SMILEYS_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define VK_SMILEYS_NEON
+#endif
 #include <util.h>
 
 #include <cpputils/trie.h>
@@ -18,6 +25,9 @@ Trie<string> ascii_to_unicode_smiley;
 // Map from unicode version to "canonical" text smiley. Used when converting messages after
 // receiving. Ascii smileys ARE escaped.
 Trie<string> unicode_to_ascii_smiley;
+// ASCII characters, which start unicode smileys (e.g. digits in keycaps). escape_incoming_text
+// matches such smileys only when the character is followed by a non-ASCII one.
+bool unicode_smiley_ascii_start[128];
 // Map from smiley to smiley image.
 typedef vector<char> SmileyImage;
 Trie<shared_ptr<SmileyImage>> smiley_images;
@@ -124,6 +134,10 @@ void process_theme_smiley_line(const vector<string>& v, const string& buf, const
         char* ascii_escaped = purple_markup_escape_text(ascii_version.data(), -1);
         unicode_to_ascii_smiley.insert(unicode_version.data(), ascii_escaped);
         g_free(ascii_escaped);
+
+        unsigned char first = unicode_version[0];
+        if (first < 128)
+            unicode_smiley_ascii_start[first] = true;
     }
 }
 
@@ -227,6 +241,173 @@ void convert_incoming_smileys(string& message)
     }
 }
 
+namespace
+{
+
+// Returns true if the character must be handled by escape_incoming_text: either escaped, checked
+// for being a start of a smiley or validated as UTF-8. Null character terminates the text.
+inline bool is_special_char(unsigned char c)
+{
+    return c >= 128 || c == '&' || c == '<' || c == '>' || c == '"' || c == '\0';
+}
+
+// Returns the length of the prefix of text, consisting of characters, which can be copied as is.
+size_t skip_plain_ascii(const char* text, size_t length)
+{
+    size_t i = 0;
+#if defined(VK_SMILEYS_SSE2)
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i quot = _mm_set1_epi8('"');
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot)));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(v, zero));
+        // Non-ASCII characters have the high bit set.
+        if (_mm_movemask_epi8(_mm_or_si128(special, v)) != 0)
+            break;
+    }
+#elif defined(VK_SMILEYS_NEON)
+    const uint8x16_t amp = vdupq_n_u8('&');
+    const uint8x16_t lt = vdupq_n_u8('<');
+    const uint8x16_t gt = vdupq_n_u8('>');
+    const uint8x16_t quot = vdupq_n_u8('"');
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t high = vdupq_n_u8(128);
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(text + i));
+        uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(v, amp), vceqq_u8(v, lt)),
+                                      vorrq_u8(vceqq_u8(v, gt), vceqq_u8(v, quot)));
+        special = vorrq_u8(special, vorrq_u8(vceqq_u8(v, zero), vcgeq_u8(v, high)));
+        uint64x2_t lanes = vreinterpretq_u64_u8(special);
+        if ((vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1)) != 0)
+            break;
+    }
+#endif
+    // The tail and the block, which contains a special character.
+    while (i < length && !is_special_char(text[i]))
+        i++;
+    return i;
+}
+
+// Returns the length of the valid UTF-8 sequence, starting at text, or zero if it is invalid.
+size_t utf8_sequence_length(const unsigned char* text, size_t length)
+{
+    unsigned char c = text[0];
+    if (c < 0x80)
+        return 1;
+
+    size_t seq_length;
+    // Bounds for the second byte exclude overlong encodings, surrogates and code points
+    // above U+10FFFF.
+    unsigned char min = 0x80;
+    unsigned char max = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        seq_length = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        seq_length = 3;
+        if (c == 0xE0)
+            min = 0xA0;
+        else if (c == 0xED)
+            max = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        seq_length = 4;
+        if (c == 0xF0)
+            min = 0x90;
+        else if (c == 0xF4)
+            max = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (seq_length > length || text[1] < min || text[1] > max)
+        return 0;
+    for (size_t i = 2; i < seq_length; i++)
+        if (text[i] < 0x80 || text[i] > 0xBF)
+            return 0;
+    return seq_length;
+}
+
+} // End of anonymous namespace
+
+string escape_incoming_text(const string& text)
+{
+    const char* p = text.data();
+    size_t length = text.length();
+    string ret;
+    // Most messages need no escaping, leave some space for a few entities.
+    ret.reserve(length + length / 8 + 16);
+
+    // Set if the previous character has been copied as is, so that it can be the start of a smiley.
+    bool prev_plain = false;
+    for (size_t i = 0; i < length;) {
+        size_t plain = skip_plain_ascii(p + i, length - i);
+        if (plain > 0) {
+            ret.append(p + i, plain);
+            i += plain;
+            prev_plain = true;
+            continue;
+        }
+
+        unsigned char c = p[i];
+        if (c == '\0')
+            break;
+        if (c < 128) {
+            switch (c) {
+            case '&':
+                ret += "&amp;";
+                break;
+            case '<':
+                ret += "&lt;";
+                break;
+            case '>':
+                ret += "&gt;";
+                break;
+            case '"':
+                ret += "&quot;";
+                break;
+            }
+            i++;
+            prev_plain = false;
+            continue;
+        }
+
+        // All smileys contain non-ASCII characters, some of them start with an ASCII one, which
+        // has already been copied.
+        size_t smiley_len;
+        const string* ascii = nullptr;
+        if (prev_plain && unicode_smiley_ascii_start[(unsigned char)p[i - 1]]) {
+            ascii = unicode_to_ascii_smiley.match(p + i - 1, &smiley_len);
+            if (ascii) {
+                ret.pop_back();
+                i--;
+            }
+        }
+        if (!ascii)
+            ascii = unicode_to_ascii_smiley.match(p + i, &smiley_len);
+        if (ascii) {
+            ret += *ascii;
+            i += smiley_len;
+            prev_plain = false;
+            continue;
+        }
+
+        size_t seq_length = utf8_sequence_length((const unsigned char*)p + i, length - i);
+        if (seq_length > 0) {
+            ret.append(p + i, seq_length);
+            i += seq_length;
+        } else {
+            // U+FFFD REPLACEMENT CHARACTER
+            ret += "\xEF\xBF\xBD";
+            i++;
+        }
+        prev_plain = false;
+    }
+    return ret;
+}
 
 void add_custom_smileys(PurpleConversation* conv, const char* message)
 {
@@ -29,6 +29,13 @@ void convert_outgoing_smileys(string& message);
 // NOTE: message MUST be escaped, added smileys will be escaped (e.g. "&amp;3" instead "<3").
 void convert_incoming_smileys(string& message);
 
+// Escapes the incoming message text, replaces invalid UTF-8 sequences with U+FFFD and converts
+// smileys in a single pass. The result is the same as purple_markup_escape_text followed by
+// convert_incoming_smileys, but the text is copied only once and runs of ASCII characters, which
+// need no escaping, are skipped with SIMD instructions if available.
+//
+// NOTE: text MUST NOT be escaped, it is processed up to the first null character.
+string escape_incoming_text(const string& text);
 
 // Adds custom smileys to the conversation, based on the smileys present in the message. This is
 // used so that even if the user did not enable the smiley theme, smileys are still shown to him.
@@ -0,0 +1,102 @@
+#include <imgstore.h>
+
+#include "vk-thumbnail-images.h"
+
+namespace
+{
+
+// The total size of held images, the least recently used ones are released after it is exceeded.
+const size_t MAX_THUMBNAIL_IMAGES_SIZE = 32 * 1024 * 1024;
+
+} // End of anonymous namespace
+
+ThumbnailImages::ThumbnailImages()
+    : m_total_size(0)
+{
+}
+
+ThumbnailImages::~ThumbnailImages()
+{
+    for (const pair<const int, Image>& p: m_images)
+        purple_imgstore_unref_by_id(p.first);
+}
+
+int ThumbnailImages::find(const string& url, uint64 peer_id)
+{
+    auto url_it = m_url_images.find(url);
+    if (url_it == m_url_images.end())
+        return 0;
+
+    int img_id = url_it->second;
+    Image& image = m_images[img_id];
+    image.peer_ids.insert(peer_id);
+    m_lru.splice(m_lru.begin(), m_lru, image.lru_it);
+    return img_id;
+}
+
+int ThumbnailImages::add(const string& url, uint64 peer_id, const char* data, size_t size)
+{
+    // Thumbnails from the same url can be downloaded concurrently.
+    int img_id = find(url, peer_id);
+    if (img_id != 0)
+        return img_id;
+
+    img_id = purple_imgstore_add_with_id(g_memdup(data, size), size, nullptr);
+    if (img_id == 0)
+        return 0;
+
+    m_lru.push_front(img_id);
+    Image& image = m_images[img_id];
+    image.url = url;
+    image.size = size;
+    image.peer_ids.insert(peer_id);
+    image.lru_it = m_lru.begin();
+    m_url_images[url] = img_id;
+    m_total_size += size;
+
+    // The image, which has just been added, is kept even if it alone exceeds the budget.
+    while (m_total_size > MAX_THUMBNAIL_IMAGES_SIZE && m_lru.back() != img_id) {
+        vkcom_debug_info("Releasing thumbnail image %d, %zu bytes held\n", m_lru.back(), m_total_size);
+        release(m_lru.back());
+    }
+    return img_id;
+}
+
+bool ThumbnailImages::is_held(int img_id) const
+{
+    return m_images.count(img_id) != 0;
+}
+
+void ThumbnailImages::release_conversation(uint64 peer_id)
+{
+    vector<int> unused;
+    for (pair<const int, Image>& p: m_images) {
+        Image& image = p.second;
+        if (image.peer_ids.erase(peer_id) != 0 && image.peer_ids.empty())
+            unused.push_back(p.first);
+    }
+    for (int img_id: unused)
+        release(img_id);
+}
+
+void ThumbnailImages::release(int img_id)
+{
+    auto it = m_images.find(img_id);
+    if (it == m_images.end())
+        return;
+
+    const Image& image = it->second;
+    m_total_size -= image.size;
+    m_url_images.erase(image.url);
+    m_lru.erase(image.lru_it);
+    m_images.erase(it);
+    purple_imgstore_unref_by_id(img_id);
+}
+
+ThumbnailImages& get_thumbnail_images(PurpleConnection* gc)
+{
+    VkData& gc_data = get_data(gc);
+    if (!gc_data.thumbnail_images)
+        gc_data.thumbnail_images.reset(new ThumbnailImages());
+    return *gc_data.thumbnail_images;
+}
@@ -0,0 +1,67 @@
+// Keeping imgstore images for received thumbnails within a memory budget.
+
+#pragma once
+
+#include <list>
+
+#include "common.h"
+
+#include <connection.h>
+
+#include "vk-common.h"
+
+// Thumbnails are added to imgstore and are shown in conversations as <img id=>. imgstore keeps
+// an image while someone references it: the conversation window takes its own reference for each
+// image it shows, while ThumbnailImages holds one reference for each image it has added. Images
+// are released when the conversations, which have shown them, are closed, and the least recently
+// used ones are released when the total size exceeds the budget. The same thumbnail, received
+// again while it is held, reuses the image instead of being downloaded and added once more.
+//
+// Released images stay alive in the windows, which show them; thumbnails in the messages, received
+// after their images have been released, are shown as links.
+class ThumbnailImages
+{
+public:
+    ThumbnailImages();
+    // Releases all images.
+    ~ThumbnailImages();
+
+    DISABLE_COPYING(ThumbnailImages)
+
+    // Returns imgstore id of the thumbnail, downloaded from url, if it is held, zero otherwise.
+    // Marks the image as recently used and used by the conversation with peer_id (user id or chat
+    // id + CHAT_ID_OFFSET, see peer_id_from_ids).
+    int find(const string& url, uint64 peer_id);
+
+    // Adds the image to imgstore for the conversation with peer_id and returns its id. Releases
+    // the least recently used images if the budget is exceeded.
+    int add(const string& url, uint64 peer_id, const char* data, size_t size);
+
+    // Returns true if the image has not been released yet.
+    bool is_held(int img_id) const;
+
+    // Stops using the images in the conversation, the images, not used by any other conversation,
+    // are released.
+    void release_conversation(uint64 peer_id);
+
+private:
+    struct Image
+    {
+        string url;
+        size_t size;
+        set<uint64> peer_ids;
+        // Position in m_lru.
+        std::list<int>::iterator lru_it;
+    };
+
+    map<int, Image> m_images;
+    map<string, int> m_url_images;
+    // Image ids, the most recently used one first.
+    std::list<int> m_lru;
+    size_t m_total_size;
+
+    void release(int img_id);
+};
+
+// Returns thumbnail images for the account, creating them upon first use.
+ThumbnailImages& get_thumbnail_images(PurpleConnection* gc);
@@ -107,20 +107,27 @@ PurpleBuddy* buddy_from_user_id(PurpleConnection* gc, uint64 user_id)
 
 } // End of anonymous namespace
 
-string get_user_display_name(PurpleConnection* gc, uint64 user_id)
+const string& get_user_display_name(PurpleConnection* gc, uint64 user_id)
 {
+    map<uint64, string>& names = get_data(gc).name_cache.display_names;
+    auto it = names.find(user_id);
+    if (it != names.end())
+        return it->second;
+
+    string& name = names[user_id];
     PurpleBuddy* buddy = buddy_from_user_id(gc, user_id);
-    if (buddy)
-        return purple_buddy_get_alias(buddy);
     VkUserInfo* info = get_user_info(gc, user_id);
-    if (info)
-        return info->real_name;
+    if (buddy)
+        name = purple_buddy_get_alias(buddy);
+    else if (info)
+        name = info->real_name;
     else
-        return user_name_from_id(user_id);
+        name = user_name_from_id(user_id);
+    return name;
 }
 
 
-string get_user_display_name(PurpleConnection* gc, uint64 user_id, uint64 chat_id)
+const string& get_user_display_name(PurpleConnection* gc, uint64 user_id, uint64 chat_id)
 {
     VkChatInfo* info = get_chat_info(gc, chat_id);
     if (!info)
@@ -133,23 +140,43 @@ string get_user_display_name(PurpleConnection* gc, uint64 user_id, uint64 chat_i
         return it->second;
 }
 
-string get_self_chat_display_name(PurpleConnection* gc)
+const string& get_self_chat_display_name(PurpleConnection* gc)
 {
+    // The alias can be changed by the user at any time, so it is compared with the cached one.
+    VkNameCache& cache = get_data(gc).name_cache;
     const char* self_alias = purple_account_get_alias(purple_connection_get_account(gc));
-    return str_format(i18n("%s (you)"), self_alias);
+    if (!self_alias || cache.self_chat_display_name.empty() || cache.self_alias != self_alias) {
+        cache.self_alias = self_alias ? self_alias : "";
+        cache.self_chat_display_name = str_format(i18n("%s (you)"), self_alias);
+    }
+    return cache.self_chat_display_name;
 }
 
-string get_unique_display_name(PurpleConnection* gc, uint64 user_id)
+const string& get_unique_display_name(PurpleConnection* gc, uint64 user_id)
 {
+    map<uint64, string>& names = get_data(gc).name_cache.unique_display_names;
+    auto it = names.find(user_id);
+    if (it != names.end())
+        return it->second;
+
+    string& name = names[user_id];
     VkUserInfo* info = get_user_info(gc, user_id);
     if (!info)
-        return user_name_from_id(user_id);
-
-    // Return either "Name (nickname)" or "Name (id)"
-    if (!info->domain.empty())
-        return str_format("%s (%s)", info->real_name.data(), info->domain.data());
+        name = user_name_from_id(user_id);
+    // Either "Name (nickname)" or "Name (id)"
+    else if (!info->domain.empty())
+        name = str_format("%s (%s)", info->real_name.data(), info->domain.data());
     else
-        return str_format("%s (%llu)", info->real_name.data(), (unsigned long long)user_id);
+        name = str_format("%s (%llu)", info->real_name.data(), (unsigned long long)user_id);
+    return name;
+}
+
+void invalidate_user_names(PurpleConnection* gc, uint64 user_id)
+{
+    VkNameCache& cache = get_data(gc).name_cache;
+    cache.display_names.erase(user_id);
+    cache.unique_display_names.erase(user_id);
+    cache.user_hrefs.erase(user_id);
 }
 
 bool user_in_buddy_list(PurpleConnection* gc, uint64 user_id)
@@ -201,6 +228,19 @@ bool is_unknown_chat(PurpleConnection* gc, uint64 chat_id)
     return !contains(get_data(gc).chat_infos, chat_id);
 }
 
+uint64 peer_id_from_conv(PurpleConversation* conv)
+{
+    const char* name = purple_conversation_get_name(conv);
+    PurpleConversationType type = purple_conversation_get_type(conv);
+    if (type == PURPLE_CONV_TYPE_IM)
+        return user_id_from_name(name, true);
+    if (type == PURPLE_CONV_TYPE_CHAT) {
+        uint64 chat_id = chat_id_from_name(name, true);
+        return chat_id != 0 ? peer_id_from_ids(0, chat_id) : 0;
+    }
+    return 0;
+}
+
 bool have_open_chat(PurpleConnection* gc, uint64 chat_id)
 {
     string name = chat_name_from_id(chat_id);
@@ -250,56 +290,6 @@ bool is_chat_manually_removed(PurpleConnection* gc, uint64 chat_id)
     return contains(get_data(gc).manually_removed_chats(), chat_id);
 }
 
-PurpleLogCache::PurpleLogCache(PurpleConnection* gc)
-    : m_gc(gc)
-{
-}
-
-PurpleLogCache::~PurpleLogCache()
-{
-    for (pair<uint64, PurpleLog*> p: m_logs)
-        purple_log_free(p.second);
-}
-
-PurpleLog* PurpleLogCache::for_user(uint64 user_id)
-{
-    if (contains(m_logs, user_id)) {
-        return m_logs[user_id];
-    } else {
-        PurpleLog* log = open_for_user_id(user_id);
-        m_logs[user_id] = log;
-        return log;
-    }
-}
-
-PurpleLog* PurpleLogCache::for_chat(uint64 chat_id)
-{
-    if (contains(m_chat_logs, chat_id)) {
-        return m_chat_logs[chat_id];
-    } else {
-        PurpleLog* log = open_for_chat_id(chat_id);
-        m_chat_logs[chat_id] = log;
-        return log;
-    }
-}
-
-PurpleLog* PurpleLogCache::open_for_user_id(uint64 user_id)
-{
-    string buddy = user_name_from_id(user_id);
-    PurpleAccount* account = purple_connection_get_account(m_gc);
-    PurpleConversation* conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, buddy.data(), account);
-    return purple_log_new(PURPLE_LOG_IM, buddy.data(), account, conv, time(nullptr), nullptr);
-}
-
-PurpleLog* PurpleLogCache::open_for_chat_id(uint64 chat_id)
-{
-    string name = chat_name_from_id(chat_id);
-    PurpleAccount* account = purple_connection_get_account(m_gc);
-    PurpleConversation* conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_CHAT, name.data(), account);
-    return purple_log_new(PURPLE_LOG_CHAT, name.data(), account, conv, time(nullptr), nullptr);
-}
-
-
 bool is_unknown_group(PurpleConnection* gc, uint64 group_id)
 {
     VkGroupInfo* info = get_group_info(gc, group_id);
@@ -363,14 +353,21 @@ void update_groups_info(PurpleConnection* gc, vector<uint64> group_ids, const Su
     });
 }
 
-string get_user_href(uint64 user_id, const VkUserInfo& info)
+const string& get_user_href(PurpleConnection* gc, uint64 user_id, const VkUserInfo& info)
 {
+    map<uint64, string>& hrefs = get_data(gc).name_cache.user_hrefs;
+    auto it = hrefs.find(user_id);
+    if (it != hrefs.end())
+        return it->second;
+
+    string& href = hrefs[user_id];
     if (!info.domain.empty())
-        return str_format("<a href='https://vk.com/%s'>%s</a>", info.domain.data(),
+        href = str_format("<a href='https://vk.com/%s'>%s</a>", info.domain.data(),
                           info.real_name.data());
     else
-        return str_format("<a href='https://vk.com/id%llu'>%s</a>", (unsigned long long)user_id,
+        href = str_format("<a href='https://vk.com/id%llu'>%s</a>", (unsigned long long)user_id,
                           info.real_name.data());
+    return href;
 }
 
 string get_group_href(uint64 group_id, const VkGroupInfo& info)
@@ -16,18 +16,24 @@ void set_account_alias(PurpleConnection* gc);
 // by message.send API call.
 string parse_vkcom_attachments(const string& message);
 
+// Display names and hrefs are cached in VkData::name_cache, the returned references are valid until
+// the next call to any of these functions or invalidate_user_names.
+
 // Gets display name for user.
-string get_user_display_name(PurpleConnection* gc, uint64 user_id);
+const string& get_user_display_name(PurpleConnection* gc, uint64 user_id);
 
 // Gets display name for user in chat.
-string get_user_display_name(PurpleConnection *gc, uint64 user_id, uint64 chat_id);
+const string& get_user_display_name(PurpleConnection *gc, uint64 user_id, uint64 chat_id);
 
 // Gets display name for self in chats (with " (you)" appended).
-string get_self_chat_display_name(PurpleConnection* gc);
+const string& get_self_chat_display_name(PurpleConnection* gc);
 
 // Gets unique display name for user, used when user has duplicate name with other user in chat,
 // appends some unique id.
-string get_unique_display_name(PurpleConnection* gc, uint64 user_id);
+const string& get_unique_display_name(PurpleConnection* gc, uint64 user_id);
+
+// Removes cached names for user. Must be called when user info or the buddy changes.
+void invalidate_user_names(PurpleConnection* gc, uint64 user_id);
 
 // Returns true if user_id is present in buddy list.
 bool user_in_buddy_list(PurpleConnection* gc, uint64 user_id);
@@ -53,6 +59,10 @@ bool is_participant_in_chat(PurpleConnection* gc, uint64 chat_id);
 // Returns true if chat is not present even in chat infos.
 bool is_unknown_chat(PurpleConnection* gc, uint64 chat_id);
 
+// Returns peer id (see peer_id_from_ids) of the IM or chat conversation or zero if the conversation
+// name is not ours.
+uint64 peer_id_from_conv(PurpleConversation* conv);
+
 // Returns VkUserInfo, corresponding to buddy or nullptr if info still has not been added.
 VkUserInfo* get_user_info(PurpleBuddy* buddy);
 VkUserInfo* get_user_info(PurpleConnection* gc, uint64 user_id);
@@ -72,28 +82,6 @@ bool is_chat_manually_added(PurpleConnection* gc, uint64 chat_id);
 // Checks if chat has manually removed from the buddy list.
 bool is_chat_manually_removed(PurpleConnection* gc, uint64 chat_id);
 
-// Map of several PurpleLogs (one for each user), so that they are not created for each received message.
-// Used in vk-message-recv.cpp
-class PurpleLogCache
-{
-public:
-    PurpleLogCache(PurpleConnection* gc);
-    ~PurpleLogCache();
-
-    // Opens PurpleLog for given user_id or returns an already open one.
-    PurpleLog* for_user(uint64 user_id);
-    // Opens PurpleLog for given chat id or returns an already open one.
-    PurpleLog* for_chat(uint64 chat_id);
-
-private:
-    PurpleConnection* m_gc;
-    map<uint64, PurpleLog*> m_logs;
-    map<uint64, PurpleLog*> m_chat_logs;
-
-    PurpleLog* open_for_user_id(uint64 user_id);
-    PurpleLog* open_for_chat_id(uint64 chat_id);
-};
-
 // Returns true if group_id is not present even in group infos or group info is stale.
 bool is_unknown_group(PurpleConnection* gc, uint64 group_id);
 
@@ -104,7 +92,7 @@ VkGroupInfo* get_group_info(PurpleConnection* gc, uint64 group_id);
 void update_groups_info(PurpleConnection* gc, vector<uint64> group_ids, const SuccessCb& success_cb);
 
 // Gets href, which points to the user page.
-string get_user_href(uint64 user_id, const VkUserInfo& info);
+const string& get_user_href(PurpleConnection* gc, uint64 user_id, const VkUserInfo& info);
 
 // Gets href, which points to the group page.
 string get_group_href(uint64 group_id, const VkGroupInfo& info);